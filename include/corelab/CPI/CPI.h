@@ -3,9 +3,13 @@
 
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/BitVector.h"
 #include "llvm/ADT/SetVector.h"
 
 
@@ -16,6 +20,15 @@ namespace corelab {
     Function *CPIInit;
     Function *CPISet; 
     Function *CPIGet; 
+    Function *CPIMemcpy;
+    Function *CPIMemmove;
+    Function *CPIMemset;
+    Function *CPIVTableCheck;
+    Function *CPIBadCall;
+    Function *CPIRegisterSites;
+    GlobalVariable *CPISiteCounts;
+    GlobalVariable *CPIVTableStart;
+    GlobalVariable *CPIVTableSize;
   };
 
   class CPIPre : public ModulePass {
@@ -37,33 +50,85 @@ namespace corelab {
   };
 
   class CPI : public ModulePass {
+  public:
+    // Cached sensitivity of one type: whether loads/stores of it need
+    // protecting, and one bit per pointer-sized slot of its allocation
+    // (capped at CPIMaxSummarySlots) whose pointer has a shadow entry.
+    struct TypeSummary {
+      bool OnLoad;
+      bool OnStore;
+      BitVector ProtectedSlots;
+      TypeSummary() : OnLoad(false), OnStore(false) {}
+    };
+    static const unsigned CPIMaxSummarySlots = 4096;
+
+  private:
     const DataLayout *DL;
     TargetLibraryInfo *TLI;
     AliasAnalysis *AA;
+    LoopInfo *LoopI;
 
     CPIFunctions CF;
 
     DenseMap<StructType*, MDNode*> StructsTBAA;
     DenseMap<StructType*, MDNode*> UnionsTBAA;
     DenseMap<Function*, bool> CalledExternally;
-
-    bool externallyCalled(Function* F);
+    // function types whose indirect calls are checked against their targets
+    DenseMap<FunctionType*, SmallVector<Function*, 4> > ClosedTargets;
+    bool OpaqueFunctionPtrs;
+
+    enum SafeAllocaKind { UnsafeAlloca, SafeAllocaReadByCalls, SafeAllocaLocal };
+    DenseMap<AllocaInst*, SafeAllocaKind> SafeAllocas;
+
+    DenseMap<Type*, TypeSummary> TypeSummaries;
+    SmallPtrSet<Type*, 8> SummaryStack;
+    bool SummaryCycle;
+
+    // Per function: protected loads whose check can reuse the one of an
+    // earlier load of the same location, and the check emitted per load.
+    SmallPtrSet<LoadInst*, 32> CheckedLoads;
+    DenseMap<LoadInst*, LoadInst*> CheckLeaders;
+    DenseMap<LoadInst*, Instruction*> SafeValues;
+    DenseMap<Loop*, SmallVector<Instruction*, 16> > LoopWriters;
+
+    // Per function: vtable pointer loads to range check (cpi-vtable-check).
+    SetVector<LoadInst*> VTableLoads;
+
+    // Per module: names of the counted sites (cpi-site-counters) and the
+    // index of the module's first counter, set by the runtime.
+    std::vector<Constant*> SiteNames;
+    GlobalVariable *SiteBase;
+
+    bool externallyCalled(Function* F, SmallPtrSetImpl<FunctionType*> &AsTypes, bool &AddressTaken);
+    void findClosedTargets(Module &M);
+    void insertTargetCheck(Instruction*);
     bool protectType(Type*, bool, MDNode* TBAATag = NULL);
+    SafeAllocaKind getSafeAllocaKind(AllocaInst*);
     bool protectLoc(Value*, bool);
     bool protectValue(Value*, bool, MDNode* TBAATag = NULL);
     bool pointsToVTable(Value*);
+    void collectVTableLoads(LoadInst*);
+    void insertVTableCheck(LoadInst*);
+    TypeSummary summarizeType(Type*);
+    const TypeSummary &getTypeSummary(Type*);
+    bool coversProtectedSlots(Value *Ptr, Value *Len);
+    bool protectMemIntrinsic(MemIntrinsic*);
+    void rewriteMemIntrinsic(MemIntrinsic*);
+    bool needsCheck(LoadInst*);
+    void findRedundantChecks(Function &F);
+    bool loopMayModify(Loop *L, Value *Loc);
+    Instruction* getSafeValue(LoadInst *LI);
+    Value* createCPIGet(IRBuilder<> &IRB, Value *Loc);
+    void createCPISet(IRBuilder<> &IRB, Value *Loc, Value *Val);
+    void countSite(IRBuilder<> &IRB, Instruction *Site, StringRef Kind);
+    void createSiteTable(Module &M);
     void insertChecks(DenseMap<Value*, Value*> &BM, Value *V, bool IsDereferenced, SetVector<std::pair<Instruction*, Instruction*> > &ReplMap);
     Function* createGlobalsReload(Module &M, StringRef N);
   public:
     static char ID;
     CPI() : ModulePass(ID) {}
 
-    void getAnalysisUsage(AnalysisUsage &AU) const {
-      AU.setPreservesCFG();
-      AU.addRequired<AAResultsWrapperPass>();
-      AU.addRequired<TargetLibraryInfoWrapperPass>();
-    }
-
+    void getAnalysisUsage(AnalysisUsage &AU) const;
     bool doInitialization(Module &M);
     bool doFinalization(Module &M);
     bool runOnFunction(Function &F);
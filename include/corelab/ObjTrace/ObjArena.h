@@ -0,0 +1,52 @@
+#ifndef LLVM_CORELAB_OBJARENA_H
+#define LLVM_CORELAB_OBJARENA_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Constants.h"
+
+#include <map>
+
+#ifndef DEBUG_TYPE
+  #define DEBUG_TYPE "objarena"
+#endif
+
+
+namespace corelab {
+  using namespace llvm;
+  using namespace std;
+
+  typedef uint64_t FullID;
+
+  // Moves the allocation sites of an arena plan (objtrace-analyze -a) to
+  // the arenas of tools/objarena.
+  class ObjArena : public ModulePass {
+    public:
+      bool runOnModule(Module& M);
+
+      virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+
+      const char *getPassName() const { return "ObjArena"; }
+
+      static char ID;
+      ObjArena() : ModulePass(ID) {}
+
+    private:
+      Module *module;
+
+      Constant *objArenaMalloc;
+      Constant *objArenaCalloc;
+      Constant *objArenaRealloc;
+      Constant *objArenaReallocNone;
+      Constant *objArenaFree;
+
+      std::map<FullID, uint32_t> plan; // site -> arena id
+
+      void setFunctions(Module &M);
+      bool readPlan();
+      void rewriteCalls();
+      void rewriteAddresses();
+  }; // class
+} // namespace
+
+#endif
@@ -4,6 +4,7 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
 
 //#include "corelab/Profilers/campMeta.h"
 //#include "corelab/Profilers/ContextTreeBuilder.h"
@@ -27,33 +28,50 @@ namespace corelab {
     public:
       bool runOnModule(Module& M);
 
-      virtual void getAnalysisUsage(AnalysisUsage &AU) const {
-        AU.addRequired< Namer >();
-        AU.setPreservesAll();
-      }
+      virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 
       const char *getPassName() const { return "ObjTrace"; }
 
       static char ID;
       ObjTrace() : ModulePass(ID) {}
 
-    private:
-      Module *module;
-
       Constant *objTraceInitialize;
       Constant *objTraceFinalize;
 
       Constant *objTraceLoadInstr;
       Constant *objTraceStoreInstr;
+      Constant *objTraceAccessBatch;
 
+      // allocation hooks, public for the table in hookMallocFree
       Constant *objTraceMalloc;
       Constant *objTraceCalloc;
       Constant *objTraceRealloc;
       Constant *objTraceFree;
+      Constant *objTraceNew;
+      Constant *objTraceDelete;
+      Constant *objTraceStrdup;
+      Constant *objTraceStrndup;
+      Constant *objTraceAlignedAlloc;
+      Constant *objTracePosixMemalign;
+      Constant *objTraceMmap;
+      Constant *objTraceMunmap;
+      Constant *objTraceArenaMalloc; // of opt -objarena
+      Constant *objTraceArenaCalloc;
+      Constant *objTraceArenaRealloc;
+      Constant *objTraceArenaFree;
+
+    private:
+      Module *module;
+
+      GlobalVariable *sampleCount;
 
       void setFunctions(Module &M);
       void setIniFini(Module &M);
 
+      void dropDuplicates(Function &F, std::vector<Instruction*> &accesses);
+      void instrumentBatched(Function &F, const std::vector<Instruction*> &accesses);
+      void instrumentAccess(Instruction *access, Value *addr, FullID fullId, Constant *hook);
+
       void hookMallocFree();
       void makeMetadata(Instruction* Instruction, uint64_t id); // From Metadata/Namer
   }; // class
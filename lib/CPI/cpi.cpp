@@ -1,3 +1,5 @@
+#define DEBUG_TYPE "cpi"
+
 #include "corelab/CPI/CPI.h"
 #include "llvm/PassSupport.h"
 #include "llvm/IR/Function.h"
@@ -5,25 +7,92 @@
 #include "llvm/IR/Operator.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/MemoryLocation.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Analysis/TargetFolder.h"
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
-#include <iostream>
 
 
 using namespace corelab;
 using namespace std;
 
+static cl::opt<bool> CPIInline("cpi-inline",
+    cl::desc("Emit the shadow table accesses inline instead of calling __cpi_get/__cpi_set"),
+    cl::init(true));
+static cl::opt<bool> CPITwoLevel("cpi-two-level",
+    cl::desc("Address the two-level shadow table (runtime built with CPI_LAYOUT=twolevel)"),
+    cl::init(false));
+static cl::opt<bool> CPIRemoveRedundant("cpi-remove-redundant",
+    cl::desc("Reuse and hoist __cpi_get checks of locations that cannot have changed"),
+    cl::init(true));
+
+static cl::opt<bool> CPISafeStack("cpi-safe-stack",
+    cl::desc("Keep provably safe allocas on the safe stack uninstrumented and move "
+             "the others to the unsafe stack (link with -fsanitize=safe-stack)"),
+    cl::init(false));
+static cl::opt<bool> CPIVTableCheck("cpi-vtable-check",
+    cl::desc("Range check vtable pointers against the read-only data of the "
+             "binary instead of leaving virtual calls unprotected"),
+    cl::init(false));
+static cl::opt<bool> CPISiteCounters("cpi-site-counters",
+    cl::desc("Count, per thread, how often every shadow table access site runs; "
+             "the runtime writes the counts out at exit or on SIGUSR2"),
+    cl::init(false));
+static cl::opt<unsigned> CPIMaxClosedTargets("cpi-max-closed-targets",
+    cl::desc("Check indirect calls whose type has at most this many possible "
+             "targets, all internal and non-escaping, by comparing against "
+             "them instead of reading the shadow table. Only sound when the "
+             "module is the whole program, e.g. after LTO (0 disables)"),
+    cl::init(0));
+
+STATISTIC(NumSafeAllocas, "Number of allocas left on the safe stack uninstrumented");
+STATISTIC(NumChecks, "Number of __cpi_get checks emitted");
+STATISTIC(NumChecksRemoved, "Number of redundant __cpi_get checks removed");
+STATISTIC(NumChecksHoisted, "Number of __cpi_get checks hoisted out of loops");
+STATISTIC(NumVTableChecks, "Number of vtable pointer range checks emitted");
+STATISTIC(NumCallsDowngraded, "Number of indirect calls checked against a closed target set");
+
+// Shadow table geometry, keep in sync with tools/cpi/cpi.h
+static const unsigned CPIGSAddrSpace = 256;   // %gs-relative on x86-64
+static const uint64_t CPIAddrMask = 0xfffffffff8ull;
+static const unsigned CPIEntryShift = 4;      // sizeof(cpi_entry) == 16
+static const unsigned CPILeafBits = 20;
+
 static void createCPIFunctions(const DataLayout *DL, Module &M, CPIFunctions &CF) {
   LLVMContext &C = M.getContext();
   Type* VoidTy = Type::getVoidTy(C);
   Type* Int8PtrTy = Type::getInt8PtrTy(C);
   Type* Int8PtrPtrTy = Int8PtrTy->getPointerTo(); 
+  Type* Int32Ty = Type::getInt32Ty(C);
+  Type* Int64Ty = Type::getInt64Ty(C);
+  Type* Int64PtrTy = Int64Ty->getPointerTo();
+  Type* SizeTy = DL->getIntPtrType(C);
 
   CF.CPIInit = cast<Function>(M.getOrInsertFunction("__cpi_init", VoidTy, NULL));
   CF.CPISet = cast<Function>(M.getOrInsertFunction("__cpi_set", VoidTy, Int8PtrPtrTy, Int8PtrTy, NULL));
   CF.CPIGet = cast<Function>(M.getOrInsertFunction("__cpi_get", Int8PtrTy, Int8PtrPtrTy, NULL));
+  CF.CPIMemcpy = cast<Function>(M.getOrInsertFunction("__cpi_memcpy", Int8PtrTy, Int8PtrTy, Int8PtrTy, SizeTy, NULL));
+  CF.CPIMemmove = cast<Function>(M.getOrInsertFunction("__cpi_memmove", Int8PtrTy, Int8PtrTy, Int8PtrTy, SizeTy, NULL));
+  CF.CPIMemset = cast<Function>(M.getOrInsertFunction("__cpi_memset", Int8PtrTy, Int8PtrTy, Int32Ty, SizeTy, NULL));
+  CF.CPIVTableCheck = cast<Function>(M.getOrInsertFunction("__cpi_vtable_check", VoidTy, Int8PtrTy, NULL));
+  CF.CPIBadCall = cast<Function>(M.getOrInsertFunction("__cpi_bad_call", VoidTy, Int8PtrTy, NULL));
+  CF.CPIBadCall->setDoesNotReturn();
+  CF.CPIRegisterSites = cast<Function>(M.getOrInsertFunction("__cpi_register_sites", VoidTy,
+                                                             Int8PtrPtrTy, Int64Ty, Int64PtrTy, NULL));
+  CF.CPISiteCounts = cast<GlobalVariable>(M.getOrInsertGlobal("__cpi_site_counts", Int64PtrTy));
+  CF.CPISiteCounts->setThreadLocalMode(GlobalVariable::InitialExecTLSModel);
+  CF.CPIVTableStart = cast<GlobalVariable>(M.getOrInsertGlobal("__cpi_vtable_start", SizeTy));
+  CF.CPIVTableSize = cast<GlobalVariable>(M.getOrInsertGlobal("__cpi_vtable_size", SizeTy));
   
 
 }
@@ -52,13 +121,38 @@ static bool isUsedAsFPtr(Value *FPtr) {
   return false;
 }
 
-static bool IsSafeStackAlloca(AllocaInst *AI, const DataLayout * DL) {
+static FunctionType* calledType(CallSite CS) {
+  return cast<FunctionType>(cast<PointerType>(CS.getCalledValue()->getType())->getElementType());
+}
+
+// Whether the alloca can stay on the safe stack: its address only reaches
+// loads and stores at constant, in-bounds offsets, constant-length memory
+// intrinsics that stay in bounds, and calls that neither capture nor access
+// it. This is a separate test from codegen's SafeStack analysis, which is
+// private to that pass, and the two can disagree; it is kept conservative
+// (variable offsets, PHIs, selects and calls that may touch the slot are all
+// rejected) so that an alloca accepted here is one SafeStack also keeps.
+// UsedByCall, when given, is set if a call or memory intrinsic other than a
+// lifetime marker reads the slot.
+static bool IsSafeStackAlloca(AllocaInst *AI, const DataLayout * DL, bool *UsedByCall = NULL) {
+  ConstantInt *ArraySize = dyn_cast<ConstantInt>(AI->getArraySize());
+  if (!ArraySize)
+    return false;
+  uint64_t AllocaSize = DL->getTypeAllocSize(AI->getAllocatedType()) *
+                        ArraySize->getZExtValue();
+  auto InBounds = [AllocaSize](int64_t Offset, uint64_t Size) {
+    return Offset >= 0 && (uint64_t)Offset <= AllocaSize &&
+           Size <= AllocaSize - (uint64_t)Offset;
+  };
+
   SmallPtrSet<Value*, 16> Visited;
-  SmallVector<Instruction*, 8> WorkList;
-  WorkList.push_back(AI);
+  SmallVector<std::pair<Instruction*, int64_t>, 8> WorkList;
+  WorkList.push_back(std::make_pair(AI, 0));
 
   while (!WorkList.empty()) {
-    Instruction *V = WorkList.pop_back_val();
+    Instruction *V = WorkList.back().first;
+    int64_t Offset = WorkList.back().second;
+    WorkList.pop_back();
     for (Value::use_iterator UI = V->use_begin(),
                              UE = V->use_end(); UI != UE; ++UI) {
       Use *U = &*UI;
@@ -67,44 +161,63 @@ static bool IsSafeStackAlloca(AllocaInst *AI, const DataLayout * DL) {
 
       switch (I->getOpcode()) {
       case Instruction::Load:
+        if (!InBounds(Offset, DL->getTypeStoreSize(I->getType())))
+          return false;
         break;
       case Instruction::VAArg:
         break;
       case Instruction::Store:
         if (V == I->getOperand(0))
           return false;
-        break;
-
-      case Instruction::GetElementPtr:
-        if (!cast<GetElementPtrInst>(I)->hasAllConstantIndices())
+        if (!InBounds(Offset, DL->getTypeStoreSize(I->getOperand(0)->getType())))
           return false;
+        break;
 
-        if (!isa<ConstantInt>(AI->getArraySize()))
+      case Instruction::GetElementPtr: {
+        APInt GEPOffset(DL->getPointerSizeInBits(), 0);
+        if (!cast<GEPOperator>(I)->accumulateConstantOffset(*DL, GEPOffset))
           return false;
+        if (Visited.insert(I).second)
+          WorkList.push_back(std::make_pair(I, Offset + GEPOffset.getSExtValue()));
+        break;
+      }
 
       case Instruction::BitCast:
-      case Instruction::PHI:
-      case Instruction::Select:
         if (Visited.insert(I).second)
-          WorkList.push_back(cast<Instruction>(I));
+          WorkList.push_back(std::make_pair(I, Offset));
         break;
 
       case Instruction::Call:
       case Instruction::Invoke: {
-        CallSite CS(I);
+        if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(I)) {
+          if (II->getIntrinsicID() == Intrinsic::lifetime_start ||
+              II->getIntrinsicID() == Intrinsic::lifetime_end)
+            continue;
+          if (MemIntrinsic *MI = dyn_cast<MemIntrinsic>(I)) {
+            ConstantInt *Len = dyn_cast<ConstantInt>(MI->getLength());
+            if (!Len || !InBounds(Offset, Len->getZExtValue()))
+              return false;
+            if (UsedByCall)
+              *UsedByCall = true;
+            continue;
+          }
+        }
 
-        if (CS.onlyReadsMemory() &&
-            I->getType()->isVoidTy())
-          continue;
+        CallSite CS(I);
+        if (UsedByCall)
+          *UsedByCall = true;
 
         CallSite::arg_iterator B = CS.arg_begin(), E = CS.arg_end();
         for (CallSite::arg_iterator A = B; A != E; ++A)
-          if (A->get() == V && !CS.doesNotCapture(A - B))
+          if (A->get() == V &&
+              !(CS.doesNotCapture(A - B) &&
+                (CS.doesNotAccessMemory() ||
+                 CS.paramHasAttr(A - B + 1, Attribute::ReadNone))))
             return false;
         continue;
       }
 
-      default:
+      default: // PHIs and selects included, their offset is unknown
         return false;
       }
     }
@@ -137,6 +250,14 @@ bool CPIPre::runOnModule(Module &M) {
   return true;
 }
 
+void CPI::getAnalysisUsage(AnalysisUsage &AU) const {
+  // the vtable and target checks branch to the runtime
+  if(!CPIVTableCheck && !CPIMaxClosedTargets)
+    AU.setPreservesCFG();
+  AU.addRequired<AAResultsWrapperPass>();
+  AU.addRequired<LoopInfoWrapperPass>();
+  AU.addRequired<TargetLibraryInfoWrapperPass>();
+}
 
 bool CPI::doInitialization(Module &M) {
 
@@ -168,101 +289,389 @@ bool CPI::doFinalization(Module &M) {
   return false;
 }
 
-bool CPI::externallyCalled(Function* F) {
-  SmallSet<Value*, 16> Visited;
+// Whether the memory of Obj, an alloca or internal global, is only reached
+// through its own address: every use, through casts and GEPs, is a load from
+// it or a store to it. Collects the pointer loads, which may read back a
+// function address stored there.
+static bool isPrivateMemory(Value *Obj, SmallVectorImpl<LoadInst*> *Loads) {
+  SmallPtrSet<Value*, 8> Visited;
+  SmallVector<Value*, 8> WorkList;
+  WorkList.push_back(Obj);
+
+  do {
+    Value *V = WorkList.pop_back_val();
+    for(Value::user_iterator i = V->user_begin(); i != V->user_end(); ++i) {
+      User *U = *i;
+      if(LoadInst *LI = dyn_cast<LoadInst>(U)) {
+        if(Loads && LI->getType()->isPointerTy())
+          Loads->push_back(LI);
+      } else if(StoreInst *SI = dyn_cast<StoreInst>(U)) {
+        if(SI->getValueOperand() == V)
+          return false;
+      } else if(isa<BitCastInst>(U) || isa<GetElementPtrInst>(U) ||
+                (isa<ConstantExpr>(U) &&
+                 (cast<ConstantExpr>(U)->getOpcode() == Instruction::BitCast ||
+                  cast<ConstantExpr>(U)->getOpcode() == Instruction::GetElementPtr))) {
+        if(Visited.insert(U).second)
+          WorkList.push_back(U);
+      } else {
+        return false;
+      }
+    }
+  } while(!WorkList.empty());
+  return true;
+}
+
+// Every function type a value of type Ty may carry or point to.
+static void collectFunctionTypes(Type *Ty, SmallPtrSetImpl<Type*> &Visited,
+                                 SmallPtrSetImpl<FunctionType*> &Types) {
+  if(!Visited.insert(Ty).second)
+    return;
+  if(FunctionType *FTy = dyn_cast<FunctionType>(Ty))
+    Types.insert(FTy);
+  for(Type::subtype_iterator i = Ty->subtype_begin(), e = Ty->subtype_end(); i != e; ++i)
+    collectFunctionTypes(*i, Visited, Types);
+}
+
+static void collectFunctionTypes(Type *Ty, SmallPtrSetImpl<FunctionType*> &Types) {
+  SmallPtrSet<Type*, 16> Visited;
+  collectFunctionTypes(Ty, Visited, Types);
+}
+
+// Whether the address of F may reach code outside the module, which could
+// then call it. Follows the address through casts, phis, selects, constant
+// initializers, arguments of calls to functions defined here, the results of
+// the calls of internal functions that return it, and memory only this
+// module can reach (allocas and internal globals whose address does not
+// leave them), where every pointer loaded back is followed in turn; anything
+// else, heap memory included, counts as an escape. Also records whether the
+// address is taken at all and every function type it is called as.
+bool CPI::externallyCalled(Function* F, SmallPtrSetImpl<FunctionType*> &AsTypes,
+                           bool &AddressTaken) {
+  SmallPtrSet<Value*, 16> Visited;
   SmallVector<Value*, 16> WorkList;
+  SmallVector<LoadInst*, 8> Loads;
   WorkList.push_back(F);
-  
+  AddressTaken = false;
+  bool Escapes = !F->hasLocalLinkage();
+
   do {
     Value *V = WorkList.pop_back_val();
 
     for(Value::user_iterator i = V->user_begin(); i != V->user_end(); ++i) {
       User *U = *i;
-      if(isa<BlockAddress>(U))
+      if(isa<BlockAddress>(U) || isa<CmpInst>(U))
         continue;
 
       CallSite CS(U);
       if(CS) {
-        if(CS.getCalledValue() != V && CS.getCalledFunction() && CS.getCalledFunction()->isDeclaration())
-          return true;
-
+        if(CS.getCalledValue() == V)
+          continue;
+        AddressTaken = true;
+        Function *Callee = CS.getCalledFunction();
+        if(!Callee || Callee->isDeclaration() || Callee->isVarArg()) {
+          Escapes = true;
+          continue;
+        }
+        for(unsigned a = 0, e = CS.arg_size(); a != e; ++a)
+          if(CS.getArgument(a) == V) {
+            Function::arg_iterator Arg = Callee->arg_begin();
+            std::advance(Arg, a);
+            if(Visited.insert(&*Arg).second)
+              WorkList.push_back(&*Arg);
+          }
         continue;
       }
 
-      Operator *OP = dyn_cast<Operator>(U);
-      if(OP) {
+      AddressTaken = true;
+      Loads.clear();
+      if(StoreInst *SI = dyn_cast<StoreInst>(U)) {
+        if(SI->getValueOperand() != V)
+          continue;
+        Value *Obj = GetUnderlyingObject(SI->getPointerOperand(), *DL);
+        GlobalVariable *GV = dyn_cast<GlobalVariable>(Obj);
+        if(!(isa<AllocaInst>(Obj) || (GV && GV->hasLocalLinkage())) ||
+           !isPrivateMemory(Obj, &Loads))
+          Escapes = true;
+      } else if(ReturnInst *RI = dyn_cast<ReturnInst>(U)) {
+        // the results of the direct calls of an internal function are
+        // followed; any other use of it may call it from anywhere
+        Function *RF = RI->getParent()->getParent();
+        if(!RF->hasLocalLinkage())
+          Escapes = true;
+        for(Value::user_iterator r = RF->user_begin(); !Escapes && r != RF->user_end(); ++r) {
+          CallSite RCS(*r);
+          if(!RCS || RCS.getCalledValue() != RF)
+            Escapes = true;
+          else if(Visited.insert(RCS.getInstruction()).second)
+            WorkList.push_back(RCS.getInstruction());
+        }
+      } else if(GlobalVariable *GV = dyn_cast<GlobalVariable>(U)) {
+        if(!GV->hasLocalLinkage() || !isPrivateMemory(GV, &Loads))
+          Escapes = true;
+      } else if(isa<ConstantStruct>(U) || isa<ConstantArray>(U) || isa<ConstantVector>(U)) {
+        if(Visited.insert(U).second)
+          WorkList.push_back(U);
+      } else if(Operator *OP = dyn_cast<Operator>(U)) {
         switch (OP->getOpcode()) {
           case Instruction::BitCast:
           case Instruction::PHI:
           case Instruction::Select:
+            if(PointerType *PTy = dyn_cast<PointerType>(U->getType())) {
+              if(FunctionType *FTy = dyn_cast<FunctionType>(PTy->getElementType()))
+                AsTypes.insert(FTy);
+              else
+                OpaqueFunctionPtrs = true;   // may come back as any type
+            }
             if(Visited.insert(U).second)
               WorkList.push_back(U);
             break;
           default:
+            Escapes = true;
             break;
         }
-
+      } else {
+        Escapes = true;
       }
+
+      for(unsigned l = 0, e = Loads.size(); l != e; ++l)
+        if(Visited.insert(Loads[l]).second)
+          WorkList.push_back(Loads[l]);
     }
   } while(!WorkList.empty());
-  return true;
+  return Escapes;
 }
 
-bool CPI::protectType(Type *Ty, bool IsStore, MDNode* TBAATag) {
-  cout << Ty->isFunctionTy() << endl;
-  cout << Ty->isPointerTy() << endl;
-  if(Ty->isFunctionTy() || (Ty->isPointerTy() && printf("hi") && cast<PointerType>(Ty)->getElementType()->isFunctionTy())) {
-    return true;
-  }
-  else if (Ty->isIntegerTy())
-    return false;
-  else if (PointerType *PTy = dyn_cast<PointerType>(Ty)) {
-    if(IsStore && PTy->getElementType()->isStructTy() &&
-        cast<StructType>(PTy->getElementType())->getNumElements() == 0 &&
-        TBAATag && TBAATag->getNumOperands() > 1 &&
-        cast<MDString>(TBAATag->getOperand(0))->getString() == "function pointer")
-      return true;
-    if(IsStore && PTy->getElementType()->isIntegerTy(8)) {
-      bool result = false;
-      if(TBAATag) {
-        for(unsigned int i = 0; i < TBAATag->getNumOperands(); i++) {
-          MDNode* tmp = dyn_cast_or_null<MDNode>(TBAATag->getOperand(i));
-          if(tmp) {
-            MDString *TagName = cast<MDString>(tmp->getOperand(0));
-            if(TagName->getString() == "void pointer" || TagName->getString() == "function pointer")
-              result = true;
-          }
+// Indirect calls whose function type only has internal, non-escaping,
+// address-taken targets: nothing outside the module can hand us a pointer of
+// that type, so the callee must be one of them. This assumes the module is
+// the whole program; a type is open anyway when code outside the module can
+// produce a value of it: it appears in the signature of a declaration or in
+// the parameters of an exported function, or is loaded from memory other
+// than the module's private allocas and internal globals, made by inttoptr,
+// or read by va_arg.
+void CPI::findClosedTargets(Module &M) {
+  ClosedTargets.clear();
+  OpaqueFunctionPtrs = false;
+  if(!CPIMaxClosedTargets)
+    return;
+  SmallPtrSet<FunctionType*, 16> OpenTypes;
+  DenseMap<Value*, bool> Private;
+
+  for(Module::iterator it = M.begin(); it != M.end(); ++it) {
+    Function *F = &*it;
+    if(F->isIntrinsic())
+      continue;
+    if(F->isDeclaration()) {
+      collectFunctionTypes(F->getFunctionType(), OpenTypes);
+    } else if(!F->hasLocalLinkage()) {
+      for(FunctionType::param_iterator pi = F->getFunctionType()->param_begin(),
+          pe = F->getFunctionType()->param_end(); pi != pe; ++pi)
+        collectFunctionTypes(*pi, OpenTypes);
+    }
+
+    for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i) {
+      Instruction *I = &*i;
+      if(isa<IntToPtrInst>(I) || isa<VAArgInst>(I)) {
+        collectFunctionTypes(I->getType(), OpenTypes);
+      } else if(LoadInst *LI = dyn_cast<LoadInst>(I)) {
+        if(!LI->getType()->isPointerTy())
+          continue;
+        Value *Obj = GetUnderlyingObject(LI->getPointerOperand(), *DL);
+        GlobalVariable *GV = dyn_cast<GlobalVariable>(Obj);
+        if(!isa<AllocaInst>(Obj) && !(GV && GV->hasLocalLinkage())) {
+          collectFunctionTypes(LI->getType(), OpenTypes);
+          continue;
         }
-        
-        TBAATag->dump();
-        TBAATag->getOperand(1).get()->dump();
-        TBAATag->getOperand(0).get()->dump(); /*
-        MDString *TagName = cast<MDString>(TBAATag->getOperand(0));
-        return TagName->getString() == "void pointer" || TagName->getString() == "function pointer";
-        */
-        return result;
+        DenseMap<Value*, bool>::iterator P = Private.find(Obj);
+        if(P == Private.end())
+          P = Private.insert(std::make_pair(Obj, isPrivateMemory(Obj, NULL))).first;
+        if(!P->second)
+          collectFunctionTypes(LI->getType(), OpenTypes);
       }
-      
-      return true;
     }
 
-    return protectType(PTy->getElementType(), IsStore);
+    SmallPtrSet<FunctionType*, 4> AsTypes;
+    bool AddressTaken;
+    CalledExternally[F] = externallyCalled(F, AsTypes, AddressTaken);
+    if(!AddressTaken)
+      continue;
+
+    AsTypes.insert(F->getFunctionType());
+    for(SmallPtrSet<FunctionType*, 4>::iterator ti = AsTypes.begin(), te = AsTypes.end(); ti != te; ++ti) {
+      if(CalledExternally[F])
+        OpenTypes.insert(*ti);
+      else
+        ClosedTargets[*ti].push_back(F);
+    }
   }
-  else if (SequentialType *PTy = dyn_cast<SequentialType>(Ty))
-    return protectType(PTy->getElementType(), IsStore);
-  else if (StructType *STy = dyn_cast<StructType>(Ty)) {
-    return false;
-    // TODO handle struct type
+
+  if(OpaqueFunctionPtrs) {
+    ClosedTargets.clear();
+    return;
   }
 
-  else
-    return false;
+  SmallVector<FunctionType*, 8> Dead;
+  for(DenseMap<FunctionType*, SmallVector<Function*, 4> >::iterator it = ClosedTargets.begin(),
+      ie = ClosedTargets.end(); it != ie; ++it)
+    if(OpenTypes.count(it->first) || it->second.size() > CPIMaxClosedTargets)
+      Dead.push_back(it->first);
+  for(unsigned i = 0, e = Dead.size(); i != e; ++i)
+    ClosedTargets.erase(Dead[i]);
+}
+
+// Replaces the shadow lookup of a call through a closed type: the callee has
+// to compare equal to one of the type's targets, or the runtime aborts.
+void CPI::insertTargetCheck(Instruction *I) {
+  CallSite CS(I);
+  Value *Callee = CS.getCalledValue();
+  FunctionType *FTy = calledType(CS);
+  const SmallVectorImpl<Function*> &Targets = ClosedTargets[FTy];
+
+  IRBuilder<> IRB(I);
+  Value *Hit = NULL;
+  for(unsigned i = 0, e = Targets.size(); i != e; ++i) {
+    Value *Eq = IRB.CreateICmpEQ(Callee, IRB.CreateBitCast(Targets[i], Callee->getType()));
+    Hit = Hit ? IRB.CreateOr(Hit, Eq) : Eq;
+  }
+
+  MDNode *Weights = MDBuilder(IRB.getContext()).createBranchWeights(1, 1 << 20);
+  TerminatorInst *Bad = SplitBlockAndInsertIfThen(IRB.CreateNot(Hit), I, true, Weights);
+  IRB.SetInsertPoint(Bad);
+  IRB.CreateCall(CF.CPIBadCall, IRB.CreatePointerCast(Callee, IRB.getInt8PtrTy()));
+  ++NumCallsDowngraded;
+}
+
+// Sensitivity of a type, independent of any instruction: code pointers, i8*
+// on stores (a void* may carry one), and everything that reaches those
+// through pointers, arrays, vectors or struct fields. Computed once per type.
+// A pointer cycle through a type still being summarized reads as not
+// sensitive; the type at the root of the walk is exact regardless, and the
+// types below it that saw the cycle are recomputed when asked for directly.
+CPI::TypeSummary CPI::summarizeType(Type *Ty) {
+  DenseMap<Type*, TypeSummary>::iterator It = TypeSummaries.find(Ty);
+  if(It != TypeSummaries.end())
+    return It->second;
+  if(!SummaryStack.insert(Ty).second) {
+    SummaryCycle = true;
+    return TypeSummary();
+  }
+
+  TypeSummary S;
+  unsigned PtrSize = DL->getPointerSize();
+  if(Ty->isFunctionTy()) {
+    S.OnLoad = S.OnStore = true;
+  } else if(PointerType *PTy = dyn_cast<PointerType>(Ty)) {
+    Type *ElemTy = PTy->getElementType();
+    if(ElemTy->isFunctionTy()) {
+      S.OnLoad = S.OnStore = true;
+    } else if(ElemTy->isIntegerTy(8)) {
+      S.OnStore = true;
+    } else {
+      TypeSummary ES = summarizeType(ElemTy);
+      S.OnLoad = ES.OnLoad;
+      S.OnStore = ES.OnStore;
+    }
+    S.ProtectedSlots.resize(1, S.OnStore);
+  } else if(SequentialType *STy = dyn_cast<SequentialType>(Ty)) {
+    TypeSummary ES = summarizeType(STy->getElementType());
+    S.OnLoad = ES.OnLoad;
+    S.OnStore = ES.OnStore;
+    if(ES.ProtectedSlots.any() && Ty->isSized()) {
+      uint64_t ElemSlots = DL->getTypeAllocSize(STy->getElementType()) / PtrSize;
+      uint64_t Slots = std::min<uint64_t>(DL->getTypeAllocSize(Ty) / PtrSize, CPIMaxSummarySlots);
+      S.ProtectedSlots.resize(Slots);
+      for(uint64_t Base = 0; ElemSlots && Base < Slots; Base += ElemSlots)
+        for(int b = ES.ProtectedSlots.find_first(); b != -1 && Base + b < Slots;
+            b = ES.ProtectedSlots.find_next(b))
+          S.ProtectedSlots.set(Base + b);
+    }
+  } else if(StructType *STy = dyn_cast<StructType>(Ty)) {
+    // opaque structs have no fields we could know about
+    if(STy->isSized()) {
+      const StructLayout *SL = DL->getStructLayout(STy);
+      uint64_t Slots = std::min<uint64_t>(
+          (SL->getSizeInBytes() + PtrSize - 1) / PtrSize, CPIMaxSummarySlots);
+      S.ProtectedSlots.resize(Slots);
+      for(unsigned i = 0, e = STy->getNumElements(); i != e; ++i) {
+        TypeSummary ES = summarizeType(STy->getElementType(i));
+        S.OnLoad |= ES.OnLoad;
+        S.OnStore |= ES.OnStore;
+        uint64_t Base = SL->getElementOffset(i) / PtrSize;
+        for(int b = ES.ProtectedSlots.find_first(); b != -1 && Base + b < Slots;
+            b = ES.ProtectedSlots.find_next(b))
+          S.ProtectedSlots.set(Base + b);
+      }
+    }
+  }
+
+  SummaryStack.erase(Ty);
+  if(!SummaryCycle || SummaryStack.empty())
+    TypeSummaries[Ty] = S;
+  return S;
+}
+
+const CPI::TypeSummary &CPI::getTypeSummary(Type *Ty) {
+  DenseMap<Type*, TypeSummary>::iterator It = TypeSummaries.find(Ty);
+  if(It != TypeSummaries.end())
+    return It->second;
+
+  SummaryCycle = false;
+  summarizeType(Ty);
+  return TypeSummaries[Ty];
+}
+
+static bool hasTBAATag(MDNode *TBAATag, StringRef Name) {
+  MDString *Tag = dyn_cast<MDString>(TBAATag->getOperand(0));
+  return Tag && Tag->getString() == Name;
+}
+
+bool CPI::protectType(Type *Ty, bool IsStore, MDNode* TBAATag) {
+  // Stores of an i8* or of a pointer to an empty struct are decided by the
+  // TBAA tag of the store, so they bypass the per-type cache.
+  PointerType *PTy = dyn_cast<PointerType>(Ty);
+  if(IsStore && TBAATag && PTy) {
+    Type *ElemTy = PTy->getElementType();
+    if(ElemTy->isStructTy() && cast<StructType>(ElemTy)->getNumElements() == 0 &&
+        TBAATag->getNumOperands() > 1 && hasTBAATag(TBAATag, "function pointer"))
+      return true;
+
+    if(ElemTy->isIntegerTy(8)) {
+      for(unsigned int i = 0; i < TBAATag->getNumOperands(); i++) {
+        MDNode* tmp = dyn_cast_or_null<MDNode>(TBAATag->getOperand(i));
+        if(tmp && (hasTBAATag(tmp, "void pointer") || hasTBAATag(tmp, "function pointer")))
+          return true;
+      }
+      return false;
+    }
+  }
+
+  const TypeSummary &S = getTypeSummary(Ty);
+  return IsStore ? S.OnStore : S.OnLoad;
 }
 
 bool CPI::protectValue(Value *Val, bool IsStore, MDNode *TBAATag) {
   return protectType(Val->getType(), IsStore, TBAATag);
 }
 
+// Safe allocas stay on the safe stack, out of reach of memory errors, so
+// loads from them need no check. Stores still have to fill the shadow when a
+// callee may read the slot through a pointer argument.
+CPI::SafeAllocaKind CPI::getSafeAllocaKind(AllocaInst *AI) {
+  DenseMap<AllocaInst*, SafeAllocaKind>::iterator It = SafeAllocas.find(AI);
+  if(It != SafeAllocas.end())
+    return It->second;
+
+  bool UsedByCall = false;
+  SafeAllocaKind Kind = UnsafeAlloca;
+  if(IsSafeStackAlloca(AI, DL, &UsedByCall)) {
+    Kind = UsedByCall ? SafeAllocaReadByCalls : SafeAllocaLocal;
+    ++NumSafeAllocas;
+  }
+  SafeAllocas[AI] = Kind;
+  return Kind;
+}
+
 bool CPI::protectLoc(Value* Loc, bool IsStore) {
   if (!IsStore && AA->pointsToConstantMemory(Loc))
     return false;
@@ -272,7 +681,6 @@ bool CPI::protectLoc(Value* Loc, bool IsStore) {
   WorkList.push_back(Loc);
   do {
     Value *P = WorkList.pop_back_val();
-    cout << P->getName().data() << endl;
     P = GetUnderlyingObject(P, *DL, 0);
     if(!Visited.insert(P).second)
       continue;
@@ -289,10 +697,12 @@ bool CPI::protectLoc(Value* Loc, bool IsStore) {
     }
 
     if(AllocaInst *AI = dyn_cast<AllocaInst>(P)) {
-      //if(!IsSafeStackAlloca(AI, DL))
+      if(!CPISafeStack)
+        return true;
+      SafeAllocaKind Kind = getSafeAllocaKind(AI);
+      if(Kind == UnsafeAlloca || (IsStore && Kind == SafeAllocaReadByCalls))
         return true;
-      cout << "SafeStack" << endl;
-      //continue;
+      continue;
     } else if (isa<GlobalVariable>(P) &&
         cast<GlobalVariable>(P)->isConstant()) {
       if(IsStore) {
@@ -336,33 +746,349 @@ bool CPI::pointsToVTable(Value *Ptr) {
   return true;
 }
 
+// LI loads a function pointer out of a vtable: remember the loads of the
+// vtable pointers it is based on.
+void CPI::collectVTableLoads(LoadInst *LI) {
+  SmallVector<Value*, 8> Objects;
+  GetUnderlyingObjects(LI->getPointerOperand(), Objects, *DL);
+  for(unsigned i = 0, e = Objects.size(); i != e; ++i)
+    if(LoadInst *VPtr = dyn_cast<LoadInst>(Objects[i]))
+      VTableLoads.insert(VPtr);
+}
+
+// vptr - __cpi_vtable_start < __cpi_vtable_size right after the load, with
+// the runtime deciding in the (cold) case that it points elsewhere. The
+// vtable itself is read-only, so its entries need no shadow lookups.
+void CPI::insertVTableCheck(LoadInst *VPtr) {
+  Instruction *SplitBefore = VPtr->getNextNode();
+  IRBuilder<> IRB(SplitBefore);
+  Value *Addr = IRB.CreatePtrToInt(VPtr, DL->getIntPtrType(IRB.getContext()));
+  Value *Off = IRB.CreateSub(Addr, IRB.CreateLoad(CF.CPIVTableStart));
+  Value *Outside = IRB.CreateICmpUGE(Off, IRB.CreateLoad(CF.CPIVTableSize));
+
+  MDNode *Weights = MDBuilder(IRB.getContext()).createBranchWeights(1, 1 << 20);
+  TerminatorInst *Slow = SplitBlockAndInsertIfThen(Outside, SplitBefore, false, Weights);
+  IRB.SetInsertPoint(Slow);
+  IRB.CreateCall(CF.CPIVTableCheck, IRB.CreatePointerCast(VPtr, IRB.getInt8PtrTy()));
+  ++NumVTableChecks;
+}
+
+// Inline equivalent of __cpi_get: the load through %gs that the runtime does
+// with __CPI_GET, without the call.
+Value* CPI::createCPIGet(IRBuilder<> &IRB, Value *Loc) {
+  Type *Int8PtrTy = IRB.getInt8PtrTy();
+  if(!CPIInline)
+    return IRB.CreateCall(CF.CPIGet, IRB.CreatePointerCast(Loc, Int8PtrTy->getPointerTo()));
+
+  Type *IntPtrTy = DL->getIntPtrType(IRB.getContext());
+  Value *Addr = IRB.CreateAnd(IRB.CreatePtrToInt(Loc, IntPtrTy), CPIAddrMask);
+
+  if(!CPITwoLevel) {
+    Value *Off = IRB.CreateShl(Addr, CPIEntryShift - 3);
+    return IRB.CreateLoad(IRB.CreateIntToPtr(Off, Int8PtrTy->getPointerTo(CPIGSAddrSpace)));
+  }
+
+  // directory slot through %gs, then the entry inside the leaf
+  Value *DirOff = IRB.CreateShl(IRB.CreateLShr(Addr, CPILeafBits + 3), 3);
+  Value *Leaf = IRB.CreateLoad(IRB.CreateIntToPtr(DirOff, IntPtrTy->getPointerTo(CPIGSAddrSpace)));
+  Value *Idx = IRB.CreateAnd(IRB.CreateLShr(Addr, 3), (1ull << CPILeafBits) - 1);
+  Value *Entry = IRB.CreateAdd(Leaf, IRB.CreateShl(Idx, CPIEntryShift));
+  return IRB.CreateLoad(IRB.CreateIntToPtr(Entry, Int8PtrTy->getPointerTo()));
+}
+
+// Inline equivalent of __cpi_set. The two-level layout may have to allocate a
+// leaf, so it keeps calling the runtime.
+void CPI::createCPISet(IRBuilder<> &IRB, Value *Loc, Value *Val) {
+  Type *Int8PtrTy = IRB.getInt8PtrTy();
+  Val = IRB.CreateBitCast(Val, Int8PtrTy);
+  if(!CPIInline || CPITwoLevel) {
+    IRB.CreateCall(CF.CPISet, {IRB.CreateBitCast(Loc, Int8PtrTy->getPointerTo()), Val});
+    return;
+  }
+
+  Type *IntPtrTy = DL->getIntPtrType(IRB.getContext());
+  Value *Addr = IRB.CreateAnd(IRB.CreatePtrToInt(Loc, IntPtrTy), CPIAddrMask);
+  Value *Off = IRB.CreateShl(Addr, CPIEntryShift - 3);
+  IRB.CreateStore(Val, IRB.CreateIntToPtr(Off, Int8PtrTy->getPointerTo(CPIGSAddrSpace)));
+}
+
+// Whether the first Len bytes behind Ptr (typed as before the casts to i8*)
+// contain a slot whose pointer has a shadow entry.
+bool CPI::coversProtectedSlots(Value *Ptr, Value *Len) {
+  Type *Ty = cast<PointerType>(Ptr->stripPointerCasts()->getType())->getElementType();
+  const TypeSummary &S = getTypeSummary(Ty);
+  int First = S.ProtectedSlots.find_first();
+  if(First == -1)
+    return false;
+
+  ConstantInt *CLen = dyn_cast<ConstantInt>(Len);
+  if(!CLen)
+    return true;
+  return (uint64_t) First * DL->getPointerSize() < CLen->getZExtValue();
+}
+
+bool CPI::protectMemIntrinsic(MemIntrinsic *MI) {
+  if(MI->isVolatile())
+    return false;
+
+  if(coversProtectedSlots(MI->getRawDest(), MI->getLength()))
+    return true;
+  if(MemTransferInst *MT = dyn_cast<MemTransferInst>(MI))
+    return coversProtectedSlots(MT->getRawSource(), MI->getLength());
+  return false;
+}
+
+// Bumps this thread's counter of the shadow table access at Site; the site
+// name is "<kind> <function> <file>:<line>", tab separated.
+void CPI::countSite(IRBuilder<> &IRB, Instruction *Site, StringRef Kind) {
+  if(!CPISiteCounters)
+    return;
+
+  Function *F = Site->getParent()->getParent();
+  std::string Name;
+  raw_string_ostream OS(Name);
+  OS << Kind << '\t' << F->getName() << '\t';
+  const DebugLoc &Loc = Site->getDebugLoc();
+  if(Loc)
+    OS << Loc->getFilename() << ':' << Loc.getLine();
+  else
+    OS << '?';
+  OS.flush();
+
+  Module &M = *F->getParent();
+  Constant *Str = ConstantDataArray::getString(M.getContext(), Name);
+  GlobalVariable *StrGV = new GlobalVariable(M, Str->getType(), true, GlobalValue::PrivateLinkage,
+                                             Str, "__cpi_module.site_name");
+  StrGV->setUnnamedAddr(true);
+  uint64_t Id = SiteNames.size();
+  SiteNames.push_back(ConstantExpr::getPointerCast(StrGV, IRB.getInt8PtrTy()));
+
+  Value *Counts = IRB.CreateLoad(CF.CPISiteCounts);
+  Value *Idx = IRB.CreateAdd(IRB.CreateLoad(SiteBase), IRB.getInt64(Id));
+  Value *Slot = IRB.CreateGEP(Counts, Idx);
+  IRB.CreateStore(IRB.CreateAdd(IRB.CreateLoad(Slot), IRB.getInt64(1)), Slot);
+}
+
+// Site names of the module, registered with the runtime by a constructor
+// that also fills in SiteBase.
+void CPI::createSiteTable(Module &M) {
+  if(SiteNames.empty())
+    return;
+
+  LLVMContext &C = M.getContext();
+  ArrayType *NamesTy = ArrayType::get(Type::getInt8PtrTy(C), SiteNames.size());
+  GlobalVariable *Names = new GlobalVariable(M, NamesTy, true, GlobalValue::PrivateLinkage,
+                                             ConstantArray::get(NamesTy, SiteNames),
+                                             "__cpi_module.site_names");
+
+  Function *F = Function::Create(FunctionType::get(Type::getVoidTy(C), false),
+                                 GlobalValue::InternalLinkage, "__cpi_module.sites", &M);
+  IRBuilder<> IRB(BasicBlock::Create(C, "", F));
+  IRB.CreateCall(CF.CPIRegisterSites, {IRB.CreatePointerCast(Names, Type::getInt8PtrTy(C)->getPointerTo()),
+                                       IRB.getInt64(SiteNames.size()), SiteBase});
+  IRB.CreateRetVoid();
+  appendToGlobalCtors(M, F, 0);
+}
+
+void CPI::rewriteMemIntrinsic(MemIntrinsic *MI) {
+  IRBuilder<> IRB(MI);
+  Type *Int8PtrTy = IRB.getInt8PtrTy();
+  Value *Dst = IRB.CreatePointerCast(MI->getRawDest(), Int8PtrTy);
+  Value *Len = IRB.CreateZExtOrTrunc(MI->getLength(), DL->getIntPtrType(IRB.getContext()));
+
+  if(MemSetInst *MS = dyn_cast<MemSetInst>(MI)) {
+    Value *Byte = IRB.CreateZExt(MS->getValue(), IRB.getInt32Ty());
+    IRB.CreateCall(CF.CPIMemset, {Dst, Byte, Len});
+    countSite(IRB, MI, "memset");
+  } else {
+    MemTransferInst *MT = cast<MemTransferInst>(MI);
+    Value *Src = IRB.CreatePointerCast(MT->getRawSource(), Int8PtrTy);
+    bool IsCpy = isa<MemCpyInst>(MT);
+    IRB.CreateCall(IsCpy ? CF.CPIMemcpy : CF.CPIMemmove, {Dst, Src, Len});
+    countSite(IRB, MI, IsCpy ? "memcpy" : "memmove");
+  }
+  MI->eraseFromParent();
+}
+
+bool CPI::needsCheck(LoadInst *LI) {
+  return LI->getType()->isPointerTy() &&
+    !LI->getMetadata("vaarg.load") &&
+    protectLoc(LI->getPointerOperand(), false) &&
+    protectValue(LI, false, LI->getMetadata(LLVMContext::MD_tbaa)) &&
+    !pointsToVTable(LI->getPointerOperand()) &&
+    isUsedAsFPtr(LI);
+}
+
+typedef DenseMap<Value*, LoadInst*> AvailableChecks;
+
+static bool sameAvailable(const AvailableChecks &A, const AvailableChecks &B) {
+  if(A.size() != B.size())
+    return false;
+  for(AvailableChecks::const_iterator it = A.begin(), ie = A.end(); it != ie; ++it) {
+    AvailableChecks::const_iterator j = B.find(it->first);
+    if(j == B.end() || j->second != it->second)
+      return false;
+  }
+  return true;
+}
+
+// Forward available-values analysis over the checked loads of F. A check is
+// available at a point if every path from the entry loads the same location
+// (same pointer after stripping casts) and nothing that AA says may write it
+// lies in between. A load that finds its location available records the
+// load that generated it in CheckLeaders and shares its check.
+void CPI::findRedundantChecks(Function &F) {
+  CheckedLoads.clear();
+  CheckLeaders.clear();
+  SafeValues.clear();
+  LoopWriters.clear();
+
+  for(inst_iterator it = inst_begin(F); it != inst_end(F); ++it)
+    if(LoadInst *LI = dyn_cast<LoadInst>(&*it))
+      if(needsCheck(LI))
+        CheckedLoads.insert(LI);
+
+  if(!CPIRemoveRedundant || CheckedLoads.size() < 2)
+    return;
+
+  uint64_t PtrSize = DL->getPointerSize();
+  ReversePostOrderTraversal<Function*> RPOT(&F);
+  DenseMap<BasicBlock*, AvailableChecks> Out;
+
+  // iterate to a fixpoint, then sweep once more to record the leaders
+  bool Record = false;
+  while(true) {
+    bool Changed = false;
+    for(ReversePostOrderTraversal<Function*>::rpo_iterator bi = RPOT.begin(), be = RPOT.end(); bi != be; ++bi) {
+      BasicBlock *BB = *bi;
+
+      // meet: intersection over the predecessors visited so far
+      AvailableChecks Avail;
+      bool First = true;
+      for(pred_iterator pi = pred_begin(BB), pe = pred_end(BB); pi != pe; ++pi) {
+        DenseMap<BasicBlock*, AvailableChecks>::iterator PO = Out.find(*pi);
+        if(PO == Out.end())
+          continue;
+        if(First) {
+          Avail = PO->second;
+          First = false;
+          continue;
+        }
+        SmallVector<Value*, 8> Dead;
+        for(AvailableChecks::iterator it = Avail.begin(), ie = Avail.end(); it != ie; ++it) {
+          AvailableChecks::iterator j = PO->second.find(it->first);
+          if(j == PO->second.end() || j->second != it->second)
+            Dead.push_back(it->first);
+        }
+        for(unsigned i = 0, e = Dead.size(); i != e; ++i)
+          Avail.erase(Dead[i]);
+      }
+
+      for(BasicBlock::iterator ii = BB->begin(), ie = BB->end(); ii != ie; ++ii) {
+        Instruction *I = &*ii;
+        if(LoadInst *LI = dyn_cast<LoadInst>(I)) {
+          if(!CheckedLoads.count(LI))
+            continue;
+          Value *Key = LI->getPointerOperand()->stripPointerCasts();
+          AvailableChecks::iterator A = Avail.find(Key);
+          if(A == Avail.end())
+            Avail[Key] = LI;
+          else if(Record)
+            CheckLeaders[LI] = A->second;
+          continue;
+        }
+
+        if(Avail.empty() || !I->mayWriteToMemory())
+          continue;
+        SmallVector<Value*, 8> Dead;
+        for(AvailableChecks::iterator it = Avail.begin(), ie = Avail.end(); it != ie; ++it)
+          if(AA->getModRefInfo(I, MemoryLocation(it->first, PtrSize)) & MRI_Mod)
+            Dead.push_back(it->first);
+        for(unsigned i = 0, e = Dead.size(); i != e; ++i)
+          Avail.erase(Dead[i]);
+      }
+
+      DenseMap<BasicBlock*, AvailableChecks>::iterator O = Out.find(BB);
+      if(O == Out.end() || !sameAvailable(O->second, Avail)) {
+        Out[BB] = Avail;
+        Changed = true;
+      }
+    }
+    if(Record)
+      break;
+    if(!Changed)
+      Record = true;
+  }
+}
+
+bool CPI::loopMayModify(Loop *L, Value *Loc) {
+  DenseMap<Loop*, SmallVector<Instruction*, 16> >::iterator W = LoopWriters.find(L);
+  if(W == LoopWriters.end()) {
+    SmallVector<Instruction*, 16> &Writers = LoopWriters[L];
+    for(Loop::block_iterator bi = L->block_begin(), be = L->block_end(); bi != be; ++bi)
+      for(BasicBlock::iterator ii = (*bi)->begin(), ie = (*bi)->end(); ii != ie; ++ii)
+        if(ii->mayWriteToMemory())
+          Writers.push_back(&*ii);
+    W = LoopWriters.find(L);
+  }
+
+  MemoryLocation ML(Loc, DL->getPointerSize());
+  for(unsigned i = 0, e = W->second.size(); i != e; ++i)
+    if(AA->getModRefInfo(W->second[i], ML) & MRI_Mod)
+      return true;
+  return false;
+}
+
+// Check (an i8* from the shadow table) guarding LI, shared with its leader.
+// A fresh check goes right after the load, or into the preheader of the
+// outermost loop that leaves the location invariant; the shadow table is
+// readable at any address, so running it speculatively there is harmless.
+Instruction* CPI::getSafeValue(LoadInst *LI) {
+  LoadInst *Leader = CheckLeaders.lookup(LI);
+  if(Leader)
+    ++NumChecksRemoved;
+  else
+    Leader = LI;
+
+  if(Instruction *Get = SafeValues.lookup(Leader))
+    return Get;
+
+  Value *Ptr = Leader->getPointerOperand();
+  Instruction *InsertPt = Leader->getNextNode();
+  if(CPIRemoveRedundant) {
+    for(Loop *L = LoopI->getLoopFor(Leader->getParent()); L; L = L->getParentLoop()) {
+      BasicBlock *Preheader = L->getLoopPreheader();
+      if(!Preheader || !L->isLoopInvariant(Ptr) || loopMayModify(L, Ptr))
+        break;
+      InsertPt = Preheader->getTerminator();
+    }
+    if(InsertPt->getParent() != Leader->getParent())
+      ++NumChecksHoisted;
+  }
+
+  IRBuilder<> IRB(InsertPt);
+  Instruction *Get = cast<Instruction>(createCPIGet(IRB, Ptr));
+  countSite(IRB, Leader, "get");
+  if(MDNode *TBAA = Leader->getMetadata(LLVMContext::MD_tbaa))
+    if(isa<CallInst>(Get))
+      Get->setMetadata(LLVMContext::MD_tbaa, TBAA);
+  ++NumChecks;
+
+  SafeValues[Leader] = Get;
+  return Get;
+}
+
 void CPI::insertChecks(DenseMap<Value*, Value*> &BM, Value *V, bool IsDereferenced, 
     SetVector<std::pair<Instruction*, Instruction*> > &ReplMap) {
   if(BM.count(V))
     return;
 
   BM[V] = NULL;
-      cout << "hi0" << endl;
   if (LoadInst *LI = dyn_cast<LoadInst>(V)) {
-      cout << "hi1" << endl;
-      cout << LI->getType()->isPointerTy() << endl;
-      cout << LI->getMetadata("vaarg.load") << endl;
-      cout << protectLoc(LI->getPointerOperand(), false) << endl;
-      cout << protectValue(LI, false, LI->getMetadata(LLVMContext::MD_tbaa)) << endl;
-      cout << pointsToVTable(LI->getPointerOperand()) << endl;
-      cout << isUsedAsFPtr(V) << endl;
-    if(LI->getType()->isPointerTy() &&
-        !LI->getMetadata("vaarg.load") &&
-        protectLoc(LI->getPointerOperand(), false) &&
-        protectValue(LI, false, LI->getMetadata(LLVMContext::MD_tbaa)) &&
-        !pointsToVTable(LI->getPointerOperand()) &&
-        isUsedAsFPtr(V)) {
-      cout << "hi2" << endl;
+    if(CheckedLoads.count(LI)) {
       IRBuilder<> IRB(LI->getNextNode());
-     
-      Instruction *SVal = IRB.CreateCall(CF.CPIGet, IRB.CreatePointerCast(LI->getPointerOperand(), IRB.getInt8PtrTy()->getPointerTo()));
-      if(MDNode *TBAA = LI->getMetadata(LLVMContext::MD_tbaa))
-        SVal->setMetadata(LLVMContext::MD_tbaa, TBAA);
+
+      Instruction *SVal = getSafeValue(LI);
       SVal = cast<Instruction>(IRB.CreateBitCast(SVal, LI->getType()));
 
       bool inserted = ReplMap.insert(std::make_pair(LI, SVal));
@@ -389,7 +1115,10 @@ bool CPI::runOnFunction(Function &F) {
   SetVector<Value*> NeedBounds;
   std::vector<std::pair<Instruction*, std::pair<Value*, Value*> > > BoundsSTabStores;
   std::set<Value*> IsDereferenced;
-  
+  SmallVector<MemIntrinsic*, 8> MemOps;
+  SafeAllocas.clear();
+  VTableLoads.clear();
+  SmallVector<Instruction*, 8> TargetChecks;
 
   for(inst_iterator it = inst_begin(F); it != inst_end(F); ++it) {
     Instruction *I = &*it;
@@ -401,15 +1130,29 @@ bool CPI::runOnFunction(Function &F) {
            cast<Operator>(SI->getValueOperand())->getOpcode() ==
             Instruction::BitCast &&
             protectValue(cast<Operator>(SI->getValueOperand())->getOperand(0), true)))) {
+        // the value is checked even when it goes into a safe alloca: loads
+        // from that alloca are not, so this is the last check it gets
         NeedBounds.insert(SI->getValueOperand());
-        BoundsSTabStores.push_back(std::make_pair(SI, std::make_pair(SI->getPointerOperand(), SI->getValueOperand())));
+        if(!CPISafeStack || protectLoc(SI->getPointerOperand(), true))
+          BoundsSTabStores.push_back(std::make_pair(SI, std::make_pair(SI->getPointerOperand(), SI->getValueOperand())));
       }
+    } else if(LoadInst *LI = dyn_cast<LoadInst>(I)) {
+      if(CPIVTableCheck && LI->getType()->isPointerTy() &&
+         pointsToVTable(LI->getPointerOperand()) && isUsedAsFPtr(LI))
+        collectVTableLoads(LI);
     } else if(isa<CallInst>(I) || isa<InvokeInst> (I)) {
+        if(MemIntrinsic *MI = dyn_cast<MemIntrinsic>(I))
+          if(protectMemIntrinsic(MI))
+            MemOps.push_back(MI);
+
         CallSite CS(I);
-        //if(!isa<Constant>(CS.getCalledValue())) {
+        if(!isa<Constant>(CS.getCalledValue()) && !CS.isInlineAsm() &&
+           ClosedTargets.count(calledType(CS))) {
+          TargetChecks.push_back(I);
+        } else {
           NeedBounds.insert(CS.getCalledValue());
           IsDereferenced.insert(CS.getCalledValue());
-        //}
+        }
 
         Function *CF = CS.getCalledFunction();
         
@@ -431,32 +1174,37 @@ bool CPI::runOnFunction(Function &F) {
       }
     }
 
+  findRedundantChecks(F);
+
   DenseMap<Value*, Value*> BoundsMap;
   SetVector<std::pair<Instruction*, Instruction*> > ReplMap;
 
   for(unsigned i = 0, e = NeedBounds.size(); i != e; ++i)
     insertChecks(BoundsMap, NeedBounds[i], IsDereferenced.find(NeedBounds[i]) != IsDereferenced.end(), ReplMap);
   
-  Type* Int8PtrTy = Type::getInt8PtrTy(C);
-  Type* Int8PtrPtrTy = Int8PtrTy->getPointerTo();
-
   for(unsigned i = 0, e = BoundsSTabStores.size(); i != e; ++i) {
     IRBuilder<> IRB(BoundsSTabStores[i].first);
-    
-    Value *Loc = IRB.CreateBitCast(BoundsSTabStores[i].second.first, Int8PtrPtrTy);
-    Value *Val = IRB.CreateBitCast(BoundsSTabStores[i].second.second, Int8PtrTy);
-    IRB.CreateCall(CF.CPISet, {Loc, Val});
+    createCPISet(IRB, BoundsSTabStores[i].second.first, BoundsSTabStores[i].second.second);
+    countSite(IRB, BoundsSTabStores[i].first, "set");
   }
 
-  //TODO Memory function Handle
-  //
-  
+  for(unsigned i = 0, e = MemOps.size(); i != e; ++i)
+    rewriteMemIntrinsic(MemOps[i]);
+
   for(unsigned i = 0, e = ReplMap.size();i != e; ++i) {
     Instruction *From = ReplMap[i].first, *To = ReplMap[i].second;
     To->takeName(From);
     From->replaceAllUsesWith(To);
   }
-  
+
+  // splits blocks, so it comes after everything that walks the CFG; a vtable
+  // pointer that already went through the shadow table needs no range check
+  for(unsigned i = 0, e = VTableLoads.size(); i != e; ++i)
+    if(!CheckedLoads.count(VTableLoads[i]))
+      insertVTableCheck(VTableLoads[i]);
+  for(unsigned i = 0, e = TargetChecks.size(); i != e; ++i)
+    insertTargetCheck(TargetChecks[i]);
+
   return true;
 }
 
@@ -481,22 +1229,31 @@ bool CPI::runOnModule(Module &M) {
       UnionsTBAA[cast<StructType>(mdconst::extract<ConstantInt>(MD->getOperand(0))->getType())] = TBAATag;
   } */
 
-  for(Module::iterator it = M.begin(); it != M.end(); ++it) {
-    Function *F = &*it;
-    CalledExternally[F] = externallyCalled(F);
-  }
+  findClosedTargets(M);
+
+  SiteNames.clear();
+  if(CPISiteCounters)
+    SiteBase = new GlobalVariable(M, Type::getInt64Ty(M.getContext()), false,
+                                  GlobalValue::InternalLinkage,
+                                  ConstantInt::get(Type::getInt64Ty(M.getContext()), 0),
+                                  "__cpi_module.site_base");
 
   for(Module::iterator it = M.begin(); it != M.end(); ++it) {
     Function &F = *it;
     if(!F.isDeclaration() && !F.getName().startswith("llvm.") &&
        !F.getName().startswith("__cpi_")) {
       AA = &getAnalysis<AAResultsWrapperPass>(F).getAAResults();
+      LoopI = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
       runOnFunction(F);
+      // codegen's SafeStack pass moves the unsafe allocas to the unsafe stack
+      if(CPISafeStack)
+        F.addFnAttr(Attribute::SafeStack);
     }
   }
 
   Function *F1 = createGlobalsReload(M, "__cpi_module.init");
   appendToGlobalCtors(M, F1, 0);
+  createSiteTable(M);
 
   Function *Main = M.getFunction("main");
   if(Main != NULL && !Main->isDeclaration()) {
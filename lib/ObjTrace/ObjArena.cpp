@@ -0,0 +1,244 @@
+#include "llvm/IR/LLVMContext.h"
+
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "corelab/Metadata/Metadata.h"
+#include "corelab/ObjTrace/ObjArena.h"
+
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <inttypes.h>
+
+using namespace std;
+using namespace corelab;
+
+/****
+ * Profile-guided allocation-site arenas. objtrace-analyze -a writes a plan
+ * from an ObjTrace trace or dependence profile: the hottest allocation sites,
+ * grouped by how often they are accessed together, one arena per group. This
+ * pass rewrites the malloc, calloc and realloc calls of the planned sites to
+ * allocate from their arena (tools/objarena), and every free and realloc to
+ * the objarena versions, which hand other pointers back to libc. Sites are
+ * matched by their Namer FullID, so the plan must come from a profile of the
+ * same module.
+ *
+ * The address of free and realloc taken in the module (a callback, a table
+ * of destructors) becomes objArenaFree and objArenaReallocNone, so indirect
+ * calls reach the arena versions too. Only the module is rewritten: objects
+ * still freed by code outside it (a library that takes ownership of them)
+ * must not be allocated from an arena.
+ *
+ * To measure the effect, run ObjTrace after this pass (opt -objarena
+ * -objtrace), link both runtimes and compare the cache-simulation reports:
+ * the rewritten calls keep the FullIDs of the original ones.
+ ****/
+
+char ObjArena::ID = 0;
+static RegisterPass<ObjArena> X("objarena", "Allocation-site arenas from an ObjTrace profile", false, false);
+
+static cl::opt<std::string> ArenaPlan("objarena-plan",
+    cl::desc("Arena plan written by objtrace-analyze -a: lines of "
+             "\"arena bump|slab site\""),
+    cl::init("prof.objtrace.arenas"), cl::value_desc("file"));
+
+STATISTIC(NumSitesArena, "Number of allocation calls moved to an arena");
+STATISTIC(NumFreesRewritten, "Number of free and realloc calls routed through objarena");
+STATISTIC(NumAddressesRewritten, "Number of other uses of free and realloc routed through objarena");
+
+// tools/objarena/objarena.h
+enum { OBJARENA_MAX = 64, OBJARENA_SLAB = 0x80000000u, OBJARENA_NONE = 0xffffffffu };
+
+static Value *castValue(IRBuilder<> &Builder, Value *from, Type *to);
+
+void ObjArena::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired< Namer >();
+  // keeps the FullIDs for a following -objtrace
+  AU.setPreservesAll();
+}
+
+void ObjArena::setFunctions(Module &M) {
+  LLVMContext &Context = getGlobalContext();
+
+  objArenaMalloc = M.getOrInsertFunction(
+      "objArenaMalloc",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt64Ty(Context), /* allocation size */
+      Type::getInt32Ty(Context), /* Arena */
+      (Type*)0);
+
+  objArenaCalloc = M.getOrInsertFunction(
+      "objArenaCalloc",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt64Ty(Context), /* Num */
+      Type::getInt64Ty(Context), /* allocation size */
+      Type::getInt32Ty(Context), /* Arena */
+      (Type*)0);
+
+  objArenaRealloc = M.getOrInsertFunction(
+      "objArenaRealloc",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt8PtrTy(Context), /* originally allocated address */
+      Type::getInt64Ty(Context), /* allocation size */
+      Type::getInt32Ty(Context), /* Arena */
+      (Type*)0);
+
+  objArenaReallocNone = M.getOrInsertFunction(
+      "objArenaReallocNone",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt8PtrTy(Context), /* originally allocated address */
+      Type::getInt64Ty(Context), /* allocation size */
+      (Type*)0);
+
+  objArenaFree = M.getOrInsertFunction(
+      "objArenaFree",
+      Type::getVoidTy(Context), /* Return type */
+      Type::getInt8PtrTy(Context), /* address to free */
+      (Type*)0);
+}
+
+bool ObjArena::readPlan() {
+  FILE *fp = fopen(ArenaPlan.c_str(), "r");
+  if (!fp) {
+    errs() << "objarena: cannot open the arena plan " << ArenaPlan << "\n";
+    return false;
+  }
+  char *line = NULL;
+  size_t len = 0;
+  while (getline(&line, &len, fp) != -1) {
+    unsigned arena;
+    char policy[8];
+    FullID site;
+    if (line[0] == '#')
+      continue;
+    if (sscanf(line, "%u %7s %" SCNu64, &arena, policy, &site) != 3 || arena >= OBJARENA_MAX) {
+      errs() << "objarena: ignoring bad plan line: " << line;
+      continue;
+    }
+    plan[site] = arena | (strcmp(policy, "slab") ? 0 : OBJARENA_SLAB);
+  }
+  free(line);
+  fclose(fp);
+  return !plan.empty();
+}
+
+bool ObjArena::runOnModule(Module& M) {
+  module = &M;
+  if (!readPlan())
+    return false;
+
+  DEBUG(errs()<<"############## runOnModule [ObjArena] START ##############\n");
+  setFunctions(M);
+  rewriteCalls();
+  rewriteAddresses();
+  DEBUG(errs()<<"############## runOnModule [ObjArena] END ##############\n");
+  return true;
+}
+
+// malloc(size) and calloc(num, size) of a planned site become objArenaMalloc
+// and objArenaCalloc with its arena; realloc(addr, size) becomes
+// objArenaRealloc with the site's arena or OBJARENA_NONE, free(addr)
+// objArenaFree. The new calls take the namer metadata of the old ones.
+void ObjArena::rewriteCalls() {
+  std::vector<Instruction*> listOfInstsToBeErased;
+  for(Module::iterator fi = module->begin(), fe = module->end(); fi != fe; ++fi) {
+    Function &F = *fi;
+    if (F.isDeclaration()) continue;
+    for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I){
+      Instruction *instruction = &*I;
+      if(!isa<InvokeInst>(instruction) && !isa<CallInst>(instruction)) continue;
+      CallSite CS(instruction);
+      Function *callee = dyn_cast<Function>(CS.getCalledValue()->stripPointerCasts());
+      if(!callee || !callee->isDeclaration()) continue;
+      StringRef name = callee->getName();
+
+      Constant *hook;
+      unsigned numArgs;
+      if (name == "malloc") {
+        hook = objArenaMalloc;
+        numArgs = 1;
+      } else if (name == "calloc") {
+        hook = objArenaCalloc;
+        numArgs = 2;
+      } else if (name == "realloc") {
+        hook = objArenaRealloc;
+        numArgs = 2;
+      } else if (name == "free") {
+        hook = objArenaFree;
+        numArgs = 1;
+      } else {
+        continue;
+      }
+      if (CS.arg_size() < numArgs) continue;
+
+      uint32_t arena = OBJARENA_NONE;
+      if (hook != objArenaFree) {
+        auto found = plan.find(Namer::getFullId(instruction));
+        if (found != plan.end())
+          arena = found->second;
+        else if (hook != objArenaRealloc)
+          continue; // not a planned site
+      }
+
+      DEBUG(errs()<< "Arena " << name << " " << arena << "\n");
+      FunctionType *hookTy = cast<FunctionType>(hook->getType()->getPointerElementType());
+      IRBuilder<> Builder(instruction);
+      std::vector<Value*> args;
+      for (unsigned i = 0; i < numArgs; ++i)
+        args.push_back(castValue(Builder, CS.getArgument(i), hookTy->getParamType(i)));
+      if (hook != objArenaFree)
+        args.push_back(Builder.getInt32(arena));
+
+      Instruction *newCallInst;
+      if (InvokeInst *invoke = dyn_cast<InvokeInst>(instruction))
+        newCallInst = Builder.CreateInvoke(hook, invoke->getNormalDest(), invoke->getUnwindDest(), args);
+      else
+        newCallInst = Builder.CreateCall(hook, args);
+      newCallInst->setMetadata("namer", instruction->getMetadata("namer"));
+      if (!instruction->getType()->isVoidTy()) {
+        if (isa<InvokeInst>(instruction))
+          Builder.SetInsertPoint(&*cast<InvokeInst>(instruction)->getNormalDest()->getFirstInsertionPt());
+        instruction->replaceAllUsesWith(castValue(Builder, newCallInst, instruction->getType()));
+      }
+      listOfInstsToBeErased.push_back(instruction);
+      if (arena != OBJARENA_NONE)
+        ++NumSitesArena;
+      else
+        ++NumFreesRewritten;
+    }
+  }
+  for(auto I: listOfInstsToBeErased) {
+    I->eraseFromParent();
+  }
+}
+
+static Value *castValue(IRBuilder<> &Builder, Value *from, Type *to){
+  if (from->getType() == to)
+    return from;
+  if (from->getType()->isIntegerTy() && to->isIntegerTy())
+    return Builder.CreateZExtOrTrunc(from, to);
+  return Builder.CreateBitOrPointerCast(from, to);
+}
+
+// Every use of free and realloc left after rewriteCalls takes their address:
+// it is passed as a callback, stored, or called through a cast. Those become
+// objArenaFree and objArenaReallocNone, so that an arena object freed through
+// such a pointer does not reach libc.
+void ObjArena::rewriteAddresses() {
+  const char *names[] = { "free", "realloc" };
+  Constant *hooks[] = { objArenaFree, objArenaReallocNone };
+  for (unsigned i = 0; i < 2; ++i) {
+    Function *F = module->getFunction(names[i]);
+    if (!F || !F->isDeclaration() || F->use_empty()) continue;
+    DEBUG(errs()<< "Arena address of " << names[i] << "\n");
+    NumAddressesRewritten += F->getNumUses();
+    F->replaceAllUsesWith(ConstantExpr::getBitCast(hooks[i], F->getType()));
+  }
+}
@@ -6,6 +6,17 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/InstIterator.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 #include "corelab/Utilities/InstInsertPt.h"
 #include "corelab/Utilities/GlobalCtors.h"
@@ -14,6 +25,7 @@
 
 #include <iostream>
 #include <vector>
+#include <set>
 #include <cstdlib>
 #include <inttypes.h>
 
@@ -23,13 +35,50 @@ using namespace corelab;
 char ObjTrace::ID = 0;
 static RegisterPass<ObjTrace> X("objtrace", "Object memory allocation tracing", false, false);
 
+static cl::opt<unsigned> SamplePeriod("objtrace-sample-period",
+    cl::desc("Trace one burst of loads and stores out of every this many, per "
+             "thread; the others skip the runtime altogether (1 traces all)"),
+    cl::init(1));
+static cl::opt<unsigned> SampleBurst("objtrace-sample-burst",
+    cl::desc("Number of consecutive accesses traced in each sampling period"),
+    cl::init(1));
+static cl::list<std::string> TraceFunctions("objtrace-functions",
+    cl::desc("Only trace the loads and stores of these functions (allocations "
+             "are always tracked)"),
+    cl::CommaSeparated, cl::value_desc("function,..."));
+
+static cl::opt<bool> DedupAccesses("objtrace-dedup",
+    cl::desc("Trace a load or store only once per loop iteration when an "
+             "earlier one of the same kind used the same address and nothing "
+             "in between can free it"),
+    cl::init(true));
+
+static cl::opt<unsigned> BatchSize("objtrace-batch-size",
+    cl::desc("Pass up to this many loads and stores of a block to the runtime "
+             "in one objTraceAccessBatch call (1 disables; not combined with "
+             "sampling)"),
+    cl::init(16));
+
+STATISTIC(NumAccessesTraced, "Number of loads and stores instrumented");
+STATISTIC(NumBatches, "Number of objTraceAccessBatch calls emitted");
+STATISTIC(NumNonHeapSkipped, "Number of stack or global accesses left uninstrumented");
+STATISTIC(NumDuplicatesSkipped, "Number of repeated accesses to the same address left uninstrumented");
+
 // Utils
 static bool isUseOfGetElementPtrInst(LoadInst *ld);
+static bool isNonHeap(Value *ptr, const DataLayout &dl, LoopInfo *li);
+static bool mayFree(Instruction *instruction);
+static Value *accessPointer(Instruction *access);
 static Value* castTo(Value* from, Value* to, InstInsertPt &out, const DataLayout *dl);
-static Function *getCalledFunction_aux(Instruction* indCall); // From AliasAnalysis/IndirectCallAnal.cpp
-static const Value *getCalledValueOfIndCall(const Instruction* indCall);
 
 
+void ObjTrace::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired< Namer >();
+  AU.addRequired< DominatorTreeWrapperPass >();
+  AU.addRequired< LoopInfoWrapperPass >();
+  AU.setPreservesAll();
+}
+
 void ObjTrace::setFunctions(Module &M) {
   LLVMContext &Context = getGlobalContext();
 
@@ -57,6 +106,82 @@ void ObjTrace::setFunctions(Module &M) {
       Type::getInt64Ty(Context), /* Instr ID */
       (Type*)0);
 
+  objTraceAccessBatch = M.getOrInsertFunction(
+      "objTraceAccessBatch",
+      Type::getVoidTy(Context), /* Return type */
+      Type::getInt8PtrTy(Context), /* {address, Instr ID} records */
+      Type::getInt64Ty(Context), /* Count */
+      (Type*)0);
+
+  objTraceNew = M.getOrInsertFunction(
+      "objTraceNew",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt64Ty(Context), /* allocation size */
+      Type::getInt32Ty(Context), /* Kind */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
+  objTraceDelete = M.getOrInsertFunction(
+      "objTraceDelete",
+      Type::getVoidTy(Context), /* Return type */
+      Type::getInt8PtrTy(Context), /* address to delete */
+      Type::getInt32Ty(Context), /* Kind */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
+  objTraceStrdup = M.getOrInsertFunction(
+      "objTraceStrdup",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt8PtrTy(Context), /* string */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
+  objTraceStrndup = M.getOrInsertFunction(
+      "objTraceStrndup",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt8PtrTy(Context), /* string */
+      Type::getInt64Ty(Context), /* max length */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
+  objTraceAlignedAlloc = M.getOrInsertFunction(
+      "objTraceAlignedAlloc",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt64Ty(Context), /* alignment */
+      Type::getInt64Ty(Context), /* allocation size */
+      Type::getInt32Ty(Context), /* Kind */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
+  objTracePosixMemalign = M.getOrInsertFunction(
+      "objTracePosixMemalign",
+      Type::getInt32Ty(Context), /* Return type */
+      Type::getInt8PtrTy(Context)->getPointerTo(), /* where to put the address */
+      Type::getInt64Ty(Context), /* alignment */
+      Type::getInt64Ty(Context), /* allocation size */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
+  objTraceMmap = M.getOrInsertFunction(
+      "objTraceMmap",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt8PtrTy(Context), /* address hint */
+      Type::getInt64Ty(Context), /* length */
+      Type::getInt32Ty(Context), /* prot */
+      Type::getInt32Ty(Context), /* flags */
+      Type::getInt32Ty(Context), /* fd */
+      Type::getInt64Ty(Context), /* offset */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
+  objTraceMunmap = M.getOrInsertFunction(
+      "objTraceMunmap",
+      Type::getInt32Ty(Context), /* Return type */
+      Type::getInt8PtrTy(Context), /* address */
+      Type::getInt64Ty(Context), /* length */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
   objTraceMalloc = M.getOrInsertFunction(
       "objTraceMalloc",
       Type::getInt8PtrTy(Context), /* Return type */
@@ -86,6 +211,46 @@ void ObjTrace::setFunctions(Module &M) {
       Type::getInt8PtrTy(Context), /* address to free */
       Type::getInt64Ty(Context), /* Instr ID */
       (Type*)0);
+
+  objTraceArenaMalloc = M.getOrInsertFunction(
+      "objTraceArenaMalloc",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt64Ty(Context), /* allocation size */
+      Type::getInt32Ty(Context), /* Arena */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
+  objTraceArenaCalloc = M.getOrInsertFunction(
+      "objTraceArenaCalloc",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt64Ty(Context), /* Num */
+      Type::getInt64Ty(Context), /* allocation size */
+      Type::getInt32Ty(Context), /* Arena */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
+  objTraceArenaRealloc = M.getOrInsertFunction(
+      "objTraceArenaRealloc",
+      Type::getInt8PtrTy(Context), /* Return type */
+      Type::getInt8PtrTy(Context), /* originally allocated address */
+      Type::getInt64Ty(Context), /* allocation size */
+      Type::getInt32Ty(Context), /* Arena */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
+  objTraceArenaFree = M.getOrInsertFunction(
+      "objTraceArenaFree",
+      Type::getVoidTy(Context), /* Return type */
+      Type::getInt8PtrTy(Context), /* address to free */
+      Type::getInt64Ty(Context), /* Instr ID */
+      (Type*)0);
+
+  // defined __thread in the runtime, which is linked at startup
+  sampleCount = dyn_cast_or_null<GlobalVariable>(M.getNamedValue("objTraceSampleCount"));
+  if (!sampleCount && SamplePeriod > 1)
+    sampleCount = new GlobalVariable(M, Type::getInt64Ty(Context), false,
+        GlobalValue::ExternalLinkage, NULL, "objTraceSampleCount", NULL,
+        GlobalVariable::InitialExecTLSModel);
 }
 
 void ObjTrace::setIniFini(Module& M) {
@@ -128,55 +293,53 @@ bool ObjTrace::runOnModule(Module& M) {
 
   DEBUG(errs()<<"############## runOnModule [ObjTrace] START ##############\n");
 
+  std::set<std::string> tracedFunctions(TraceFunctions.begin(), TraceFunctions.end());
   for(Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
     Function &F = *fi;
-    LLVMContext &Context = getGlobalContext();
-    const DataLayout &dataLayout = module->getDataLayout();
-    std::vector<Value*> args(0);
     if (F.isDeclaration()) continue;
+    if (!tracedFunctions.empty() && !tracedFunctions.count(F.getName())) continue;
+
+    // collect first, sampling gates split the blocks
+    LoopInfo &loopInfo = getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+    std::vector<Instruction*> accesses;
     for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I){
       Instruction *instruction = &*I;
+      Value *addr;
+      if(LoadInst *ld = dyn_cast<LoadInst>(instruction)) {
+        if(isUseOfGetElementPtrInst(ld)) continue;
+        addr = ld->getPointerOperand();
+      }
+      else if (StoreInst *st = dyn_cast<StoreInst>(instruction))
+        addr = st->getPointerOperand();
+      else
+        continue;
+
+      // the runtime would find no allocation for it anyway
+      if (isNonHeap(addr, M.getDataLayout(), &loopInfo)) {
+        ++NumNonHeapSkipped;
+        continue;
+      }
+      accesses.push_back(instruction);
+    }
+    if (DedupAccesses)
+      dropDuplicates(F, accesses);
+
+    if (BatchSize > 1 && SamplePeriod <= 1) {
+      instrumentBatched(F, accesses);
+      continue;
+    }
+    for (Instruction *instruction : accesses) {
       // For each load instructions
       if(LoadInst *ld = dyn_cast<LoadInst>(instruction)) {
-        if(isUseOfGetElementPtrInst(ld) == false){
-          args.resize (2);
-          Value *addr = ld->getPointerOperand();
-          Value *temp = ConstantInt::get(Type::getInt64Ty(Context), 0);
-          InstInsertPt out = InstInsertPt::Before(ld);
-          addr = castTo(addr, temp, out, &dataLayout);
-
-          //InstrID instrId = Namer::getInstrId(instruction);
-          //Value *instructionId = ConstantInt::get(Type::getInt16Ty(Context), instrId);
-          FullID fullId = Namer::getFullId(instruction);
-          Value *fullId_ = ConstantInt::get(Type::getInt64Ty(Context), fullId);
-          //for debug
-          //errs()<<"<"<<instrId<<"> "<<*ld<<"\n";
-
-          DEBUG(errs()<< "load instruction id %" << fullId << "\n");
-
-          args[0] = addr;
-          args[1] = fullId_;
-          CallInst::Create(objTraceLoadInstr, args, "", ld);
-        }
+        FullID fullId = Namer::getFullId(instruction);
+        DEBUG(errs()<< "load instruction id %" << fullId << "\n");
+        instrumentAccess(ld, ld->getPointerOperand(), fullId, objTraceLoadInstr);
       }
       // For each store instructions
       else if (StoreInst *st = dyn_cast<StoreInst>(instruction)) {
-        args.resize (2);
-        Value *addr = st->getPointerOperand();
-        Value *temp = ConstantInt::get(Type::getInt64Ty(Context), 0);
-        InstInsertPt out = InstInsertPt::Before(st);
-        addr = castTo(addr, temp, out, &dataLayout);
-
-        //InstrID instrId = Namer::getInstrId(instruction);
-        //Value *instructionId = ConstantInt::get(Type::getInt16Ty(Context), instrId);
         FullID fullId = Namer::getFullId(instruction);
-        Value *fullId_ = ConstantInt::get(Type::getInt64Ty(Context), fullId);
-
         DEBUG(errs()<< "store instruction id %" << fullId << "\n");
-
-        args[0] = addr;
-        args[1] = fullId_;
-        CallInst::Create(objTraceStoreInstr, args, "", st);
+        instrumentAccess(st, st->getPointerOperand(), fullId, objTraceStoreInstr);
       }
     }
   }
@@ -188,216 +351,257 @@ bool ObjTrace::runOnModule(Module& M) {
   return false;
 }
 
+// Drops the accesses that repeat an earlier kept access of the same kind to
+// the same pointer value in the same iteration of the same innermost loop:
+// the earlier one dominates it, and no call in between can have freed the
+// object. Between blocks the whole loop (or function, outside loops) must be
+// free of calls, within a block only the instructions in between.
+void ObjTrace::dropDuplicates(Function &F, std::vector<Instruction*> &accesses) {
+  DominatorTree &domTree = getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+  LoopInfo &loopInfo = getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+
+  DenseMap<Loop*, bool> callFree;
+  auto isCallFree = [&](Loop *loop) {
+    auto it = callFree.find(loop);
+    if (it != callFree.end())
+      return it->second;
+    bool noCalls = true;
+    if (loop) {
+      for (BasicBlock *bb : loop->blocks())
+        for (Instruction &instruction : *bb)
+          noCalls &= !mayFree(&instruction);
+    } else {
+      for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+        noCalls &= !mayFree(&*I);
+    }
+    return callFree[loop] = noCalls;
+  };
+
+  typedef std::pair<Value*, unsigned> AccessKey;
+  DenseMap<AccessKey, SmallVector<Instruction*, 2> > kept;
+  std::vector<Instruction*> result;
+  for (Instruction *instruction : accesses) {
+    Value *addr = accessPointer(instruction);
+    SmallVector<Instruction*, 2> &same =
+      kept[AccessKey(addr->stripPointerCasts(), instruction->getOpcode())];
+    Loop *loop = loopInfo.getLoopFor(instruction->getParent());
+
+    bool duplicate = false;
+    for (Instruction *earlier : same) {
+      if (loopInfo.getLoopFor(earlier->getParent()) != loop)
+        continue;
+      if (earlier->getParent() == instruction->getParent()) {
+        duplicate = true;
+        for (BasicBlock::iterator I(earlier); &*I != instruction && duplicate; ++I)
+          duplicate = !mayFree(&*I);
+      } else {
+        duplicate = domTree.dominates(earlier, instruction) && isCallFree(loop);
+      }
+      if (duplicate)
+        break;
+    }
+
+    if (duplicate) {
+      ++NumDuplicatesSkipped;
+      continue;
+    }
+    same.push_back(instruction);
+    result.push_back(instruction);
+  }
+  accesses.swap(result);
+}
+
+// Records the accesses of each block in a stack array of {addr, fullId}
+// (bit 63 of addr set for stores, as in the trace) and hands the array to
+// objTraceAccessBatch before the next call, before the terminator, or when it
+// is full. Calls flush it because they may free what the batch points to;
+// allocation hooks are calls too, so the runtime sees the same sequence of
+// events as with one call per access. A batch of one is a plain call.
+void ObjTrace::instrumentBatched(Function &F, const std::vector<Instruction*> &accesses) {
+  LLVMContext &Context = getGlobalContext();
+  const DataLayout &dataLayout = module->getDataLayout();
+  Type *int64Ty = Type::getInt64Ty(Context);
+  Value *temp = ConstantInt::get(int64Ty, 0);
+  AllocaInst *batch = NULL;
+
+  auto flush = [&](std::vector<Instruction*> &pending, Instruction *insertBefore) {
+    if (pending.size() == 1) {
+      Instruction *access = pending[0];
+      instrumentAccess(access, accessPointer(access), Namer::getFullId(access),
+                       isa<LoadInst>(access) ? objTraceLoadInstr : objTraceStoreInstr);
+    } else if (!pending.empty()) {
+      if (!batch) {
+        Type *recordTy = StructType::get(int64Ty, int64Ty, NULL);
+        batch = new AllocaInst(ArrayType::get(recordTy, BatchSize), "objtrace.batch",
+                               &*F.getEntryBlock().getFirstInsertionPt());
+      }
+      for (unsigned i = 0; i < pending.size(); ++i) {
+        Instruction *access = pending[i];
+        InstInsertPt out = InstInsertPt::Before(access);
+        Value *addr = castTo(accessPointer(access), temp, out, &dataLayout);
+        IRBuilder<> Builder(access);
+        if (isa<StoreInst>(access))
+          addr = Builder.CreateOr(addr, Builder.getInt64(1ull << 63));
+        Value *record = Builder.CreateConstGEP2_32(NULL, batch, 0, i);
+        Builder.CreateStore(addr, Builder.CreateStructGEP(NULL, record, 0));
+        Builder.CreateStore(Builder.getInt64(Namer::getFullId(access)),
+                            Builder.CreateStructGEP(NULL, record, 1));
+      }
+      IRBuilder<> Builder(insertBefore);
+      Value *args[] = {Builder.CreatePointerCast(batch, Builder.getInt8PtrTy()),
+                       Builder.getInt64(pending.size())};
+      Builder.CreateCall(objTraceAccessBatch, args);
+      NumAccessesTraced += pending.size();
+      ++NumBatches;
+    }
+    pending.clear();
+  };
+
+  std::set<Instruction*> traced(accesses.begin(), accesses.end());
+  std::vector<BasicBlock*> blocks; // accesses are in block order
+  for (Instruction *access : accesses)
+    if (blocks.empty() || blocks.back() != access->getParent())
+      blocks.push_back(access->getParent());
+
+  for (BasicBlock *bb : blocks) {
+    std::vector<Instruction*> pending;
+    for (BasicBlock::iterator I = bb->begin(), E = bb->end(); I != E; ++I) {
+      Instruction *instruction = &*I;
+      if (mayFree(instruction) || isa<TerminatorInst>(instruction) ||
+          (traced.count(instruction) && pending.size() == BatchSize))
+        flush(pending, instruction);
+      if (traced.count(instruction))
+        pending.push_back(instruction);
+    }
+  }
+}
+
+// Calls hook(addr, fullId) before the access, behind the sampling gate if
+// there is one: the thread's objTraceSampleCount runs from 0 to period - 1
+// and the access is traced while it is below the burst length.
+void ObjTrace::instrumentAccess(Instruction *access, Value *addr, FullID fullId, Constant *hook) {
+  LLVMContext &Context = getGlobalContext();
+  const DataLayout &dataLayout = module->getDataLayout();
+  Value *temp = ConstantInt::get(Type::getInt64Ty(Context), 0);
+  InstInsertPt out = InstInsertPt::Before(access);
+  addr = castTo(addr, temp, out, &dataLayout);
+
+  IRBuilder<> Builder(access);
+  if (SamplePeriod > 1) {
+    uint64_t burst = std::min<uint64_t>(std::max<unsigned>(SampleBurst, 1), SamplePeriod);
+    Value *count = Builder.CreateAdd(Builder.CreateLoad(sampleCount), Builder.getInt64(1));
+    count = Builder.CreateSelect(Builder.CreateICmpEQ(count, Builder.getInt64(SamplePeriod)),
+                                 Builder.getInt64(0), count);
+    Builder.CreateStore(count, sampleCount);
+    Value *sampled = Builder.CreateICmpULT(count, Builder.getInt64(burst));
+    MDNode *weights = MDBuilder(Context).createBranchWeights(burst, SamplePeriod - burst);
+    Builder.SetInsertPoint(SplitBlockAndInsertIfThen(sampled, access, false, weights));
+  }
+
+  Value *args[] = {addr, ConstantInt::get(Type::getInt64Ty(Context), fullId)};
+  Builder.CreateCall(hook, args);
+  ++NumAccessesTraced;
+}
+
+// How an allocation function is replaced: the first numArgs arguments of the
+// call, then kind if it is not NoKind, then the FullID of the call.
+namespace {
+  struct AllocHook {
+    const char *name;
+    Constant *ObjTrace::*hook;
+    unsigned numArgs;
+    int kind;
+  };
+}
+
+// AllocKind of tools/objtrace/objtraceruntime.h, which static_asserts these
+enum { NoKind = -1, AllocNew = 3, AllocNewArray = 4, AllocNewNothrow = 5,
+       AllocNewArrayNothrow = 6, AllocMemalign = 8, AllocAlignedAlloc = 9 };
+
+static const AllocHook allocHooks[] = {
+  {"malloc", &ObjTrace::objTraceMalloc, 1, NoKind},
+  {"calloc", &ObjTrace::objTraceCalloc, 2, NoKind},
+  {"realloc", &ObjTrace::objTraceRealloc, 2, NoKind},
+  {"free", &ObjTrace::objTraceFree, 1, NoKind},
+  {"_Znwm", &ObjTrace::objTraceNew, 1, AllocNew},
+  {"_Znam", &ObjTrace::objTraceNew, 1, AllocNewArray},
+  {"_ZnwmRKSt9nothrow_t", &ObjTrace::objTraceNew, 1, AllocNewNothrow},
+  {"_ZnamRKSt9nothrow_t", &ObjTrace::objTraceNew, 1, AllocNewArrayNothrow},
+  {"_ZdlPv", &ObjTrace::objTraceDelete, 1, AllocNew},
+  {"_ZdlPvm", &ObjTrace::objTraceDelete, 1, AllocNew},
+  {"_ZdlPvRKSt9nothrow_t", &ObjTrace::objTraceDelete, 1, AllocNew},
+  {"_ZdaPv", &ObjTrace::objTraceDelete, 1, AllocNewArray},
+  {"_ZdaPvm", &ObjTrace::objTraceDelete, 1, AllocNewArray},
+  {"_ZdaPvRKSt9nothrow_t", &ObjTrace::objTraceDelete, 1, AllocNewArray},
+  {"strdup", &ObjTrace::objTraceStrdup, 1, NoKind},
+  {"strndup", &ObjTrace::objTraceStrndup, 2, NoKind},
+  {"aligned_alloc", &ObjTrace::objTraceAlignedAlloc, 2, AllocAlignedAlloc},
+  {"memalign", &ObjTrace::objTraceAlignedAlloc, 2, AllocMemalign},
+  {"posix_memalign", &ObjTrace::objTracePosixMemalign, 3, NoKind},
+  {"mmap", &ObjTrace::objTraceMmap, 6, NoKind},
+  {"mmap64", &ObjTrace::objTraceMmap, 6, NoKind},
+  {"munmap", &ObjTrace::objTraceMunmap, 2, NoKind},
+  // calls rewritten by opt -objarena
+  {"objArenaMalloc", &ObjTrace::objTraceArenaMalloc, 2, NoKind},
+  {"objArenaCalloc", &ObjTrace::objTraceArenaCalloc, 3, NoKind},
+  {"objArenaRealloc", &ObjTrace::objTraceArenaRealloc, 3, NoKind},
+  {"objArenaFree", &ObjTrace::objTraceArenaFree, 1, NoKind},
+};
+
+static Value *castValue(IRBuilder<> &Builder, Value *from, Type *to){
+  if (from->getType() == to)
+    return from;
+  if (from->getType()->isIntegerTy() && to->isIntegerTy())
+    return Builder.CreateZExtOrTrunc(from, to);
+  return Builder.CreateBitOrPointerCast(from, to);
+}
+
 void ObjTrace::hookMallocFree(){
   LLVMContext &Context = getGlobalContext();
-  //const DataLayout &dataLayout = module->getDataLayout();
+  StringMap<const AllocHook*> hooks;
+  for (const AllocHook &hook : allocHooks)
+    hooks[hook.name] = &hook;
+
   std::list<Instruction*> listOfInstsToBeErased;
   for(Module::iterator fi = module->begin(), fe = module->end(); fi != fe; ++fi) {
     Function &F = *fi;
-    std::vector<Value*> args(0);
     if (F.isDeclaration()) continue;
     for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I){
       Instruction *instruction = &*I;
-      bool wasBitCasted = false;
-      Type *ty;
+      if(!isa<InvokeInst>(instruction) && !isa<CallInst>(instruction)) continue;
+      CallSite CS(instruction);
+      // calls through a bitcast of the function too
+      Function *callee = dyn_cast<Function>(CS.getCalledValue()->stripPointerCasts());
+      if(!callee || !callee->isDeclaration()) continue;
+      auto found = hooks.find(callee->getName());
+      if(found == hooks.end() || CS.arg_size() < found->second->numArgs) continue;
+      const AllocHook &allocHook = *found->second;
+
+      uint64_t fullId = Namer::getFullId(instruction);
+      DEBUG(errs()<< "Hook " << allocHook.name << "\n");
+      Constant *hook = this->*allocHook.hook;
+      FunctionType *hookTy = cast<FunctionType>(hook->getType()->getPointerElementType());
       IRBuilder<> Builder(instruction);
-      if(isa<InvokeInst>(instruction) || isa<CallInst>(instruction)){
-        Function *callee = getCalledFunction_aux(instruction);
-        if(!callee){
-          const Value *calledVal = getCalledValueOfIndCall(instruction);
-          if(const Function *tarFun = dyn_cast<Function>(calledVal->stripPointerCasts())){
-            wasBitCasted = true;
-            ty = calledVal->getType();
-            callee = const_cast<Function *>(tarFun);
-          }
-        }
-        if(!callee) continue;
-        if(callee->isDeclaration() == false) continue;
-
-
-        if(CallInst *callInst = dyn_cast<CallInst>(instruction)){
-          if(callee->getName() == "malloc"){
-            //InstrID instrId = Namer::getInstrId(instruction);
-            uint64_t fullId = Namer::getFullId(instruction);
-            //Value *instructionId = ConstantInt::get(Type::getInt16Ty(Context), instrId);
-            Value *fullId_ = ConstantInt::get(Type::getInt64Ty(Context), fullId);
-            DEBUG(errs()<< "Malloc\n");
-            args.resize(2);
-            args[0] = instruction->getOperand(0);
-            args[1] = fullId_;
-            if(wasBitCasted){
-              Value * changeTo = Builder.CreateBitCast(objTraceMalloc, ty);
-              CallInst *newCallInst = Builder.CreateCall(changeTo, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            } else {
-              CallInst *newCallInst = Builder.CreateCall(objTraceMalloc, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            }
-          }
-          else if(callee->getName() == "calloc"){
-            //InstrID instrId = Namer::getInstrId(instruction);
-            uint64_t fullId = Namer::getFullId(instruction);
-            //Value *instructionId = ConstantInt::get(Type::getInt16Ty(Context), instrId);
-            Value *fullId_ = ConstantInt::get(Type::getInt64Ty(Context), fullId);
-            DEBUG(errs()<< "Calloc\n");
-            args.resize(3);
-            args[0] = instruction->getOperand(0);
-            args[1] = instruction->getOperand(1);
-            args[2] = fullId_;
-            if(wasBitCasted){
-              Value *changeTo = Builder.CreateBitCast(objTraceCalloc, ty);
-              CallInst *newCallInst = Builder.CreateCall(changeTo, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            } else {
-              CallInst *newCallInst = Builder.CreateCall(objTraceCalloc, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            }
-          }
-          else if(callee->getName() == "realloc"){
-            //InstrID instrId = Namer::getInstrId(instruction);
-            uint64_t fullId = Namer::getFullId(instruction);
-            //Value *instructionId = ConstantInt::get(Type::getInt16Ty(Context), instrId);
-            Value *fullId_ = ConstantInt::get(Type::getInt64Ty(Context), fullId);
-            DEBUG(errs()<< "Realloc\n");
-            args.resize(3);
-            args[0] = instruction->getOperand(0);
-            args[1] = instruction->getOperand(1);
-            args[2] = fullId_;
-            if(wasBitCasted){
-              Value *changeTo = Builder.CreateBitCast(objTraceRealloc, ty);
-              CallInst *newCallInst = Builder.CreateCall(changeTo, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            } else {
-              CallInst *newCallInst = Builder.CreateCall(objTraceRealloc, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            }
-          }
-          else if(callee->getName() == "free"){
-            //InstrID instrId = Namer::getInstrId(instruction);
-            uint64_t fullId = Namer::getFullId(instruction);
-            //Value *instructionId = ConstantInt::get(Type::getInt16Ty(Context), instrId);
-            Value *fullId_ = ConstantInt::get(Type::getInt64Ty(Context), fullId);
-            DEBUG(errs()<< "Free\n");
-            args.resize(2);
-            args[0] = instruction->getOperand(0);
-            args[1] = fullId_;
-            if(wasBitCasted){
-              Value *changeTo = Builder.CreateBitCast(objTraceFree, ty);
-              CallInst *newCallInst = Builder.CreateCall(changeTo, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            } else {
-              CallInst *newCallInst = Builder.CreateCall(objTraceFree, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            }
-          }
-        }
-        else if(InvokeInst *callInst = dyn_cast<InvokeInst>(instruction)){
-          if(callee->getName() == "malloc"){
-            //InstrID instrId = Namer::getInstrId(instruction);
-            uint64_t fullId = Namer::getFullId(instruction);
-            //Value *instructionId = ConstantInt::get(Type::getInt16Ty(Context), instrId);
-            Value *fullId_ = ConstantInt::get(Type::getInt64Ty(Context), fullId);
-            args.resize(2);
-            args[0] = instruction->getOperand(0);
-            args[1] = fullId_;
-            if(wasBitCasted){
-              Value *changeTo = Builder.CreateBitCast(objTraceMalloc, ty);
-              CallInst *newCallInst = Builder.CreateCall(changeTo, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            } else {
-              CallInst *newCallInst = Builder.CreateCall(objTraceMalloc, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            }
-          }
-          else if(callee->getName() == "calloc"){
-            //InstrID instrId = Namer::getInstrId(instruction);
-            uint64_t fullId = Namer::getFullId(instruction);
-            //Value *instructionId = ConstantInt::get(Type::getInt16Ty(Context), instrId);
-            Value *fullId_ = ConstantInt::get(Type::getInt64Ty(Context), fullId);
-            args.resize(3);
-            args[0] = instruction->getOperand(0);
-            args[1] = instruction->getOperand(1);
-            args[2] = fullId_;
-            if(wasBitCasted){
-              Value *changeTo = Builder.CreateBitCast(objTraceCalloc, ty);
-              CallInst *newCallInst = Builder.CreateCall(changeTo, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            } else {
-              CallInst *newCallInst = Builder.CreateCall(objTraceCalloc, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            }
-          }
-          else if(callee->getName() == "realloc"){
-            //InstrID instrId = Namer::getInstrId(instruction);
-            uint64_t fullId = Namer::getFullId(instruction);
-            //Value *instructionId = ConstantInt::get(Type::getInt16Ty(Context), instrId);
-            Value *fullId_ = ConstantInt::get(Type::getInt64Ty(Context), fullId);
-            args.resize(3);
-            args[0] = instruction->getOperand(0);
-            args[1] = instruction->getOperand(1);
-            args[2] = fullId_;
-            if(wasBitCasted){
-              Value *changeTo = Builder.CreateBitCast(objTraceRealloc, ty);
-              CallInst *newCallInst = Builder.CreateCall(changeTo, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            } else {
-              CallInst *newCallInst = Builder.CreateCall(objTraceRealloc, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            }
-          }
-          else if(callee->getName() == "free"){
-            //InstrID instrId = Namer::getInstrId(instruction);
-            uint64_t fullId = Namer::getFullId(instruction);
-            //Value *instructionId = ConstantInt::get(Type::getInt16Ty(Context), instrId);
-            Value *fullId_ = ConstantInt::get(Type::getInt64Ty(Context), fullId);
-            args.resize(2);
-            args[0] = instruction->getOperand(0);
-            args[1] = fullId_;
-            if(wasBitCasted){
-              Value *changeTo = Builder.CreateBitCast(objTraceFree, ty);
-              CallInst *newCallInst = Builder.CreateCall(changeTo, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            } else {
-              CallInst *newCallInst = Builder.CreateCall(objTraceFree, args, "");
-              makeMetadata(newCallInst, fullId);
-              instruction->replaceAllUsesWith(newCallInst);
-              listOfInstsToBeErased.push_back(instruction);
-            }
-          }
-        }
-        else
-          assert(0&&"ERROR!!");
-      }// closing bracket for "if(isa<InvokeInst>(instruction) || isa<CallInst>(instruction)){"
+      std::vector<Value*> args;
+      for (unsigned i = 0; i < allocHook.numArgs; ++i)
+        args.push_back(castValue(Builder, CS.getArgument(i), hookTy->getParamType(i)));
+      if (allocHook.kind != NoKind)
+        args.push_back(Builder.getInt32(allocHook.kind));
+      args.push_back(ConstantInt::get(Type::getInt64Ty(Context), fullId));
+
+      Instruction *newCallInst;
+      if (InvokeInst *invoke = dyn_cast<InvokeInst>(instruction))
+        newCallInst = Builder.CreateInvoke(hook, invoke->getNormalDest(), invoke->getUnwindDest(), args);
+      else
+        newCallInst = Builder.CreateCall(hook, args);
+      makeMetadata(newCallInst, fullId);
+      if (!instruction->getType()->isVoidTy()) {
+        // the result is used after an invoke only in its normal destination
+        if (isa<InvokeInst>(instruction))
+          Builder.SetInsertPoint(&*cast<InvokeInst>(instruction)->getNormalDest()->getFirstInsertionPt());
+        instruction->replaceAllUsesWith(castValue(Builder, newCallInst, instruction->getType()));
+      }
+      listOfInstsToBeErased.push_back(instruction);
     } // for bb
   } // for ff
   for(auto I: listOfInstsToBeErased) {
@@ -426,6 +630,26 @@ static bool isUseOfGetElementPtrInst(LoadInst *ld){
   return std::all_of(ld->user_begin(), ld->user_end(), [](User *user){return isa<GetElementPtrInst>(user);});
 }
 
+// Every object the pointer can be based on is a stack slot or a global.
+static bool isNonHeap(Value *ptr, const DataLayout &dl, LoopInfo *li){
+  SmallVector<Value*, 4> objects;
+  GetUnderlyingObjects(ptr, objects, dl, li);
+  return std::all_of(objects.begin(), objects.end(),
+                     [](Value *obj){return isa<AllocaInst>(obj) || isa<GlobalValue>(obj);});
+}
+
+// Whether a heap object can be freed (and the address reused) by it.
+static bool mayFree(Instruction *instruction){
+  return (isa<CallInst>(instruction) || isa<InvokeInst>(instruction)) &&
+         !isa<IntrinsicInst>(instruction);
+}
+
+static Value *accessPointer(Instruction *access){
+  if (LoadInst *ld = dyn_cast<LoadInst>(access))
+    return ld->getPointerOperand();
+  return cast<StoreInst>(access)->getPointerOperand();
+}
+
 static Value* castTo(Value* from, Value* to, InstInsertPt &out, const DataLayout *dl)
 {
   LLVMContext &Context = getGlobalContext();
@@ -474,29 +698,3 @@ static Value* castTo(Value* from, Value* to, InstInsertPt &out, const DataLayout
 
   return from;
 }
-
-//TODO:: where to put this useful function?
-//BONGJUN:: From CAMP/ContextTreeBuilder.cpp
-static const Value *getCalledValueOfIndCall(const Instruction* indCall){
-  if(const CallInst *callInst = dyn_cast<CallInst>(indCall)){
-    return callInst->getCalledValue();
-  }
-  else if(const InvokeInst *invokeInst = dyn_cast<InvokeInst>(indCall)){
-    return invokeInst->getCalledValue();
-  }
-  else
-    assert(0 && "WTF??");
-}
-
-//TODO:: where to put this useful function?
-//BONGJUN:: From AliasAnalysis/IndirectCallAnal.cpp
-static Function *getCalledFunction_aux(Instruction* indCall){
-  if(CallInst *callInst = dyn_cast<CallInst>(indCall)){
-    return callInst->getCalledFunction();
-  }
-  else if(InvokeInst *invokeInst = dyn_cast<InvokeInst>(indCall)){
-    return invokeInst->getCalledFunction();
-  }
-  else
-    assert(0 && "WTF??");
-}
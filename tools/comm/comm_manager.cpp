@@ -12,6 +12,7 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include "comm_manager.h"
 #include "TimeUtil.h"
@@ -79,6 +80,23 @@ namespace corelab {
     }
   }
 
+  void writevComplete(int sock, struct iovec* iov, int iovcnt){
+    while(iovcnt > 0){
+      ssize_t wSize = writev(sock,iov,iovcnt);
+      if(wSize <= 0)
+        continue;
+      while(iovcnt > 0 && (size_t)wSize >= iov->iov_len){
+        wSize -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+      if(iovcnt > 0){
+        iov->iov_base = (char*)iov->iov_base + wSize;
+        iov->iov_len -= wSize;
+      }
+    }
+  }
+
   JobQueue* CommManager::getJobQue(){
     return jobQue;
   }
@@ -479,6 +497,36 @@ namespace corelab {
 
   }
 
+  void CommManager::sendQue(TAG tag, const void* data, size_t size, uint32_t destID){
+    if(tag == 0 || tag == 1000)
+      return; // error : only for tagged requests
+    Queue* targetQue;
+    if(sendQues[destID]->find(tag) == sendQues[destID]->end()){
+      Queue* newQue = (Queue*)malloc(sizeof(Queue));
+      initializeQueue(*newQue);
+      sendQues[destID]->insert(std::pair<TAG,Queue*>(tag,newQue));
+      targetQue = newQue;
+    }
+    else
+      targetQue = (*(sendQues[destID]))[tag];
+    assert(targetQue->size + size <= Q_MAX && "message too large for the receiver");
+
+    uint32_t header[3];
+    header[0] = targetQue->size + (uint32_t)size;
+    header[1] = tag;
+    header[2] = localID;
+    struct iovec iov[3];
+    iov[0].iov_base = header;
+    iov[0].iov_len = 12;
+    iov[1].iov_base = targetQue->data;
+    iov[1].iov_len = targetQue->size;
+    iov[2].iov_base = const_cast<void*>(data);
+    iov[2].iov_len = size;
+    writevComplete(socketMap[destID],iov,3);
+
+    initializeQueue(*targetQue);
+  }
+
   QWord CommManager::takeWord(uint32_t sourceID){
     Queue* targetQue = NULL;
 
@@ -75,6 +75,9 @@ namespace corelab {
     bool pushWord(TAG tag, QWord word, uint32_t destID);
     bool pushRange(TAG tag, const void* data, size_t size, uint32_t destID);
     void sendQue(TAG tag, uint32_t destID);
+    // sendQue with size bytes of data appended to the message, written
+    // from data itself rather than copied into the queue
+    void sendQue(TAG tag, const void* data, size_t size, uint32_t destID);
 
     // direct send interface
     //void sendWord(QWord word, int* cid = NULL);
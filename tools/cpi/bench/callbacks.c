@@ -0,0 +1,55 @@
+/* Event loop dispatching through per-object callback tables. */
+#include <stdio.h>
+#include <stdlib.h>
+
+struct conn;
+
+struct conn_ops {
+  void (*on_read)(struct conn *, int);
+  void (*on_write)(struct conn *, int);
+  int (*want)(struct conn *);
+};
+
+struct conn {
+  const struct conn_ops *ops;
+  void (*done)(struct conn *);
+  long bytes;
+  int state;
+};
+
+static void count_read(struct conn *c, int n) { c->bytes += n; }
+static void count_write(struct conn *c, int n) { c->bytes -= n / 2; }
+static void echo_read(struct conn *c, int n) { c->bytes += 2 * n; c->state ^= 1; }
+static void echo_write(struct conn *c, int n) { c->bytes -= n; }
+static int want_state(struct conn *c) { return c->state; }
+static int want_parity(struct conn *c) { return c->bytes & 1; }
+static void finish(struct conn *c) { c->bytes = 0; }
+
+static struct conn_ops counting = { count_read, count_write, want_state };
+static struct conn_ops echoing = { echo_read, echo_write, want_parity };
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 100000;
+  int rounds = argc > 2 ? atoi(argv[2]) : 500;
+  struct conn *conns = calloc(n, sizeof(struct conn));
+  for(int i = 0; i < n; ++i) {
+    conns[i].ops = rand() & 1 ? &counting : &echoing;
+    conns[i].done = finish;
+  }
+
+  long total = 0;
+  for(int r = 0; r < rounds; ++r)
+    for(int i = 0; i < n; ++i) {
+      struct conn *c = &conns[(i * 7919) % n];
+      if(c->ops->want(c))
+        c->ops->on_write(c, r & 63);
+      else
+        c->ops->on_read(c, i & 63);
+      if(c->bytes > (1 << 20))
+        c->done(c);
+      total += c->bytes;
+    }
+  printf("%ld\n", total);
+  free(conns);
+  return 0;
+}
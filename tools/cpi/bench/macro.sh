@@ -0,0 +1,15 @@
+#!/bin/sh
+# Runs every program built with and without the cpi pass and prints the
+# slowdown, peak RSS and page faults of the instrumented build.
+#
+# usage: macro.sh program...
+
+printf "%-10s %9s %9s %9s %11s %11s %10s %10s\n" program "base s" "cpi s" slowdown \
+  "base rss kB" "cpi rss kB" "base flt" "cpi flt"
+for prog in "$@"; do
+  base=$(./runstat ./$prog.base 2>&1 >/dev/null | tail -n 1)
+  cpi=$(./runstat ./$prog.cpi 2>&1 >/dev/null | tail -n 1)
+  echo "$base $cpi" | awk -v p=$prog '{
+    printf "%-10s %9.3f %9.3f %8.2fx %11d %11d %10d %10d\n",
+      p, $1, $5, ($1 > 0 ? $5 / $1 : 0), $2, $6, $3 + $4, $7 + $8 }'
+done
@@ -0,0 +1,70 @@
+/****
+ * micro.c
+ *
+ * ns/op of the inlined __cpi_set/__cpi_get fast path for three address
+ * patterns over one buffer of pointer slots:
+ *   seq     consecutive slots
+ *   stride  every 4097th slot, a new shadow page on every access
+ *   random  uniformly random slots
+ * plus the shadow RSS each pattern leaves behind.
+ *
+ * usage: micro [slots] [ops]
+ ****/
+#include "../cpi.c"
+#include <time.h>
+
+static void dummy() {}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t* make_pattern(const char *name, size_t nslots, size_t nops) {
+  size_t *idx = malloc(nops * sizeof(size_t));
+  uint64_t x = 88172645463325252ull;
+  for(size_t i = 0; i < nops; ++i) {
+    if(!strcmp(name, "seq")) {
+      idx[i] = i % nslots;
+    } else if(!strcmp(name, "stride")) {
+      idx[i] = (i * 4097) % nslots;
+    } else {
+      x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+      idx[i] = x % nslots;
+    }
+  }
+  return idx;
+}
+
+int main(int argc, char **argv) {
+  size_t nslots = argc > 1 ? strtoul(argv[1], 0, 0) : (1 << 24);
+  size_t nops = argc > 2 ? strtoul(argv[2], 0, 0) : (1 << 24);
+  const char *patterns[] = { "seq", "stride", "random" };
+  void *fn = (void *) dummy;
+
+  __cpi_init();
+  printf("%-8s %10s %10s %14s\n", "pattern", "set ns/op", "get ns/op", "shadow rss kB");
+
+  for(int p = 0; p < 3; ++p) {
+    void **slots = malloc(nslots * sizeof(void *));
+    size_t *idx = make_pattern(patterns[p], nslots, nops);
+    size_t bad = 0;
+
+    double t0 = now_ns();
+    for(size_t i = 0; i < nops; ++i)
+      __cpi_set(&slots[idx[i]], fn);
+    double t1 = now_ns();
+    for(size_t i = 0; i < nops; ++i)
+      bad += __cpi_get(&slots[idx[i]]) != fn;
+    double t2 = now_ns();
+
+    printf("%-8s %10.2f %10.2f %14lu%s\n", patterns[p],
+           (t1 - t0) / nops, (t2 - t1) / nops, __cpi_shadow_rss() / 1024,
+           bad ? "  (WRONG VALUES READ BACK)" : "");
+
+    free(idx);
+    free(slots);   // clears the shadow again before the next pattern
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+/* qsort with comparators picked from a table of function pointers. */
+#include <stdio.h>
+#include <stdlib.h>
+
+struct rec {
+  int key;
+  int age;
+  double score;
+};
+
+typedef int (*cmp_fn)(const void *, const void *);
+
+static int by_key(const void *a, const void *b) {
+  return ((const struct rec *) a)->key - ((const struct rec *) b)->key;
+}
+static int by_age(const void *a, const void *b) {
+  return ((const struct rec *) a)->age - ((const struct rec *) b)->age;
+}
+static int by_score(const void *a, const void *b) {
+  double d = ((const struct rec *) a)->score - ((const struct rec *) b)->score;
+  return (d > 0) - (d < 0);
+}
+
+static cmp_fn comparators[] = { by_key, by_age, by_score };
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000000;
+  int rounds = argc > 2 ? atoi(argv[2]) : 12;
+  struct rec *recs = malloc(n * sizeof(struct rec));
+  for(int i = 0; i < n; ++i) {
+    recs[i].key = rand();
+    recs[i].age = rand() % 100;
+    recs[i].score = rand() / (double) RAND_MAX;
+  }
+
+  long check = 0;
+  for(int r = 0; r < rounds; ++r) {
+    cmp_fn cmp = comparators[r % 3];
+    qsort(recs, n, sizeof(struct rec), cmp);
+    check += recs[n / 2].key;
+  }
+  printf("%ld\n", check);
+  free(recs);
+  return 0;
+}
@@ -0,0 +1,43 @@
+/****
+ * runstat.c
+ *
+ * Runs a command and prints "<seconds> <max rss kB> <minor faults>
+ * <major faults>" for it on stderr.
+ *
+ * usage: runstat command [args...]
+ ****/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+int main(int argc, char **argv) {
+  if(argc < 2) {
+    fprintf(stderr, "usage: %s command [args...]\n", argv[0]);
+    return 2;
+  }
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pid_t pid = fork();
+  if(pid == 0) {
+    execvp(argv[1], argv + 1);
+    perror("execvp");
+    _exit(127);
+  }
+
+  int status;
+  struct rusage ru;
+  if(wait4(pid, &status, 0, &ru) < 0) {
+    perror("wait4");
+    return 2;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  fprintf(stderr, "%.3f %ld %ld %ld\n",
+          (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+          ru.ru_maxrss, ru.ru_minflt, ru.ru_majflt);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
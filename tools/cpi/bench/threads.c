@@ -0,0 +1,97 @@
+/****
+ * threads.c
+ *
+ * __cpi_set/__cpi_get throughput as the number of threads grows. Every
+ * thread is created through the runtime's pthread_create, fills the shadow
+ * entries of its own buffer of code pointers and then reads them back.
+ *
+ * usage: threads [max threads] [slots per thread] [rounds]
+ ****/
+#include "../cpi.c"
+#include <time.h>
+
+static size_t nslots = 1 << 20;
+static int nrounds = 16;
+static pthread_barrier_t barrier;
+
+typedef struct {
+  void **slots;
+  double set_ns;
+  double get_ns;
+  size_t bad;
+} worker;
+
+static void dummy() {}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void* run_worker(void *p) {
+  worker *w = p;
+  void *fn = (void *) dummy;
+  size_t bad = 0;
+
+  pthread_barrier_wait(&barrier);
+  double t0 = now_ns();
+  for(int r = 0; r < nrounds; ++r)
+    for(size_t i = 0; i < nslots; ++i)
+      __cpi_set(&w->slots[i], fn);
+
+  pthread_barrier_wait(&barrier);
+  double t1 = now_ns();
+  for(int r = 0; r < nrounds; ++r)
+    for(size_t i = 0; i < nslots; ++i)
+      bad += __cpi_get(&w->slots[i]) != fn;
+  double t2 = now_ns();
+
+  w->set_ns = t1 - t0;
+  w->get_ns = t2 - t1;
+  w->bad = bad;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+  if(argc > 2)
+    nslots = strtoul(argv[2], 0, 0);
+  if(argc > 3)
+    nrounds = atoi(argv[3]);
+
+  __cpi_init();
+  printf("%8s %14s %14s %12s %12s\n", "threads", "set Mops/s", "get Mops/s",
+         "set ns/op", "get ns/op");
+
+  for(int n = 1; n <= max_threads; n *= 2) {
+    worker *ws = calloc(n, sizeof(worker));
+    pthread_t *tids = calloc(n, sizeof(pthread_t));
+    pthread_barrier_init(&barrier, 0, n);
+    for(int i = 0; i < n; ++i) {
+      ws[i].slots = malloc(nslots * sizeof(void *));
+      pthread_create(&tids[i], 0, run_worker, &ws[i]);
+    }
+
+    double set_ns = 0, get_ns = 0;
+    size_t bad = 0;
+    for(int i = 0; i < n; ++i) {
+      pthread_join(tids[i], 0);
+      set_ns = ws[i].set_ns > set_ns ? ws[i].set_ns : set_ns;
+      get_ns = ws[i].get_ns > get_ns ? ws[i].get_ns : get_ns;
+      bad += ws[i].bad;
+      free(ws[i].slots);
+    }
+
+    double ops = (double) n * nslots * nrounds;
+    printf("%8d %14.1f %14.1f %12.2f %12.2f%s\n", n,
+           ops / set_ns * 1e3, ops / get_ns * 1e3,
+           set_ns * n / ops, get_ns * n / ops,
+           bad ? "  (WRONG VALUES READ BACK)" : "");
+
+    pthread_barrier_destroy(&barrier);
+    free(tids);
+    free(ws);
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+// Virtual dispatch over a heap of objects of several classes.
+#include <cstdio>
+#include <cstdlib>
+
+struct Shape {
+  virtual ~Shape() {}
+  virtual double area() const = 0;
+  virtual void grow(double f) = 0;
+};
+
+struct Square : Shape {
+  double s;
+  Square(double s) : s(s) {}
+  double area() const { return s * s; }
+  void grow(double f) { s *= f; }
+};
+
+struct Rect : Shape {
+  double w, h;
+  Rect(double w, double h) : w(w), h(h) {}
+  double area() const { return w * h; }
+  void grow(double f) { w *= f; }
+};
+
+struct Circle : Shape {
+  double r;
+  Circle(double r) : r(r) {}
+  double area() const { return 3.14159 * r * r; }
+  void grow(double f) { r *= f; }
+};
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 100000;
+  int rounds = argc > 2 ? atoi(argv[2]) : 500;
+  Shape **shapes = new Shape*[n];
+  for(int i = 0; i < n; ++i) {
+    switch(rand() % 3) {
+    case 0: shapes[i] = new Square(1.0); break;
+    case 1: shapes[i] = new Rect(1.0, 2.0); break;
+    default: shapes[i] = new Circle(1.0); break;
+    }
+  }
+
+  double total = 0;
+  for(int r = 0; r < rounds; ++r)
+    for(int i = 0; i < n; ++i) {
+      shapes[i]->grow(1.000001);
+      total += shapes[i]->area();
+    }
+  printf("%f\n", total);
+
+  for(int i = 0; i < n; ++i)
+    delete shapes[i];
+  delete[] shapes;
+  return 0;
+}
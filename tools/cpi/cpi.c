@@ -1,11 +1,366 @@
+#define _GNU_SOURCE
 #include "cpi.h"
+#include <dlfcn.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <link.h>
 #include <asm/prctl.h>
 #include <sys/prctl.h>
 
 void* __cpi_table = 0;
+cpi_stats __cpi_stats;
+uintptr_t __cpi_vtable_start = 0;
+uintptr_t __cpi_vtable_size = 0;
+
+static int cpi_resolve_hooks();
+
+#ifdef CPI_TWO_LEVEL
+static cpi_entry* __cpi_zero_leaf = 0;
+static char* __cpi_pool = 0;
+static size_t __cpi_pool_next = 0;
+
+static void* cpi_map(void *addr, size_t size, int prot) {
+  void *p = mmap(addr, size, prot,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(p == (void *) -1) {
+    perror("mmap error in cpi.cc");
+  }
+  return p;
+}
+
+// Slow path of __cpi_set: the directory slot still points at the zero leaf.
+// Leaves are handed out in first-touch order, so the live part of the shadow
+// stays packed at the start of the pool whatever the program's address layout.
+static cpi_entry* cpi_alloc_leaf(size_t dir_off) {
+  cpi_entry **slot = (cpi_entry **) ((char *) __cpi_table + dir_off);
+  size_t off = __sync_fetch_and_add(&__cpi_pool_next, CPI_LEAF_SIZE);
+  cpi_entry *leaf = (cpi_entry *) (__cpi_pool + off);
+
+  cpi_entry *old = __sync_val_compare_and_swap(slot, __cpi_zero_leaf, leaf);
+  if(old != __cpi_zero_leaf) {
+    // another thread won; our leaf was never touched, so it costs no memory
+    __sync_fetch_and_add(&__cpi_stats.leaf_races, 1);
+    return old;
+  }
+  __sync_fetch_and_add(&__cpi_stats.leaves, 1);
+  return leaf;
+}
+#endif
+
+// Sum of the Rss lines of every mapping that lies inside [start, end).
+static size_t cpi_mapping_rss(size_t start, size_t end) {
+  FILE *fp = fopen("/proc/self/smaps", "r");
+  if(!fp)
+    return 0;
+
+  char line[256];
+  size_t total = 0, lo, hi, kb;
+  int inside = 0;
+  while(fgets(line, sizeof(line), fp)) {
+    if(sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+      inside = (lo >= start && hi <= end);
+    else if(inside && sscanf(line, "Rss: %lu kB", &kb) == 1)
+      total += kb * 1024;
+  }
+  fclose(fp);
+  return total;
+}
+
+size_t __cpi_shadow_rss() {
+#ifdef CPI_TWO_LEVEL
+  size_t dir = (size_t) __cpi_table;
+  size_t pool = (size_t) __cpi_pool;
+  return cpi_mapping_rss(dir, dir + CPI_DIR_NUM_ENTRIES * sizeof(void *)) +
+    cpi_mapping_rss(pool, pool + CPI_DIR_NUM_ENTRIES * CPI_LEAF_SIZE);
+#else
+  size_t table = (size_t) __cpi_table;
+  return cpi_mapping_rss(table, table + CPI_TABLE_NUM_ENTRIES * sizeof(cpi_entry));
+#endif
+}
+
+#ifdef CPI_STATS
+static void cpi_print_stats() {
+  fprintf(stderr, "[cpi] layout %s, leaves %lu (lost races %lu), shadow rss %lu kB, "
+          "reclaimed %lu kB over %lu frees\n",
+#ifdef CPI_TWO_LEVEL
+          "two-level",
+#else
+          "flat",
+#endif
+          __cpi_stats.leaves, __cpi_stats.leaf_races, __cpi_shadow_rss() / 1024,
+          __cpi_stats.reclaimed / 1024, __cpi_stats.frees);
+}
+#endif
+
+// Read-only data of one loaded object: from its first read-only segment
+// (.rodata; the text segment if rodata shares it) to the end of the last one
+// or of PT_GNU_RELRO (.data.rel.ro), whichever is later.
+static void cpi_ro_range(struct dl_phdr_info *info, uintptr_t *lo, uintptr_t *hi) {
+  uintptr_t ro_lo = UINTPTR_MAX, ro_hi = 0, rx_lo = UINTPTR_MAX, rx_hi = 0, relro_hi = 0;
+  for(int i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+    uintptr_t end = start + ph->p_memsz;
+    if(ph->p_type == PT_GNU_RELRO) {
+      relro_hi = end;
+    } else if(ph->p_type == PT_LOAD && !(ph->p_flags & PF_W)) {
+      // the read-only segment at offset 0 holds the ELF and dynamic headers
+      if(ph->p_flags & PF_X) {
+        rx_lo = start < rx_lo ? start : rx_lo;
+        rx_hi = end > rx_hi ? end : rx_hi;
+      } else if(ph->p_offset != 0) {
+        ro_lo = start < ro_lo ? start : ro_lo;
+        ro_hi = end > ro_hi ? end : ro_hi;
+      }
+    }
+  }
+  if(ro_lo == UINTPTR_MAX) {
+    ro_lo = rx_lo;
+    ro_hi = rx_hi;
+  }
+  *lo = ro_lo;
+  *hi = relro_hi > ro_hi ? relro_hi : ro_hi;
+}
+
+// dl_iterate_phdr lists the executable first
+static int cpi_exe_ro_range(struct dl_phdr_info *info, size_t size, void *data) {
+  uintptr_t lo, hi;
+  cpi_ro_range(info, &lo, &hi);
+  if(lo < hi) {
+    __cpi_vtable_start = lo;
+    __cpi_vtable_size = hi - lo;
+  }
+  return 1;
+}
+
+static int cpi_in_ro_range(struct dl_phdr_info *info, size_t size, void *data) {
+  uintptr_t vptr = (uintptr_t) data, lo, hi;
+  cpi_ro_range(info, &lo, &hi);
+  return vptr >= lo && vptr < hi;
+}
+
+// Slow path of the vtable check: vtables of classes defined in shared
+// libraries (including dlopen'ed ones) live outside the executable.
+void __cpi_vtable_check(void *vptr) {
+  if(dl_iterate_phdr(cpi_in_ro_range, vptr))
+    return;
+  fprintf(stderr, "[cpi] vtable pointer %p outside read-only data\n", vptr);
+  abort();
+}
+
+void __cpi_bad_call(void *target) {
+  fprintf(stderr, "[cpi] indirect call to %p outside its target set\n", target);
+  abort();
+}
+
+// Site counters. Counter arrays are per thread and never freed: a thread that
+// exits hands its array to the next new thread, which keeps adding to it, so
+// the sum over all arrays is always the total. Threads that started before
+// the first module registered (or beyond CPI_MAX_SITE_ARRAYS) share the sink.
+typedef struct {
+  const char **names;
+  uint64_t num_sites;
+  uint64_t base;
+} cpi_site_table;
+
+static uint64_t cpi_site_sink[CPI_MAX_SITES];
+__thread uint64_t *__cpi_site_counts = cpi_site_sink;
+
+static cpi_site_table cpi_site_tables[CPI_MAX_SITE_TABLES];
+static size_t cpi_num_site_tables = 0;
+static uint64_t cpi_num_sites = 0;
+static uint64_t *cpi_site_arrays[CPI_MAX_SITE_ARRAYS];
+static size_t cpi_num_site_arrays = 0;
+static uint64_t *cpi_site_free[CPI_MAX_SITE_ARRAYS];
+static size_t cpi_num_site_free = 0;
+static pthread_mutex_t cpi_site_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cpi_site_key;
+
+static void cpi_site_release(void *counts) {
+  pthread_mutex_lock(&cpi_site_lock);
+  cpi_site_free[cpi_num_site_free++] = counts;
+  pthread_mutex_unlock(&cpi_site_lock);
+}
+
+static void cpi_site_setup_thread() {
+  if(!cpi_num_sites || __cpi_site_counts != cpi_site_sink)
+    return;
+
+  uint64_t *counts = 0;
+  pthread_mutex_lock(&cpi_site_lock);
+  if(cpi_num_site_free) {
+    counts = cpi_site_free[--cpi_num_site_free];
+  } else if(cpi_num_site_arrays < CPI_MAX_SITE_ARRAYS) {
+    counts = mmap(0, CPI_MAX_SITES * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(counts == (void *) -1)
+      counts = 0;
+    else
+      cpi_site_arrays[cpi_num_site_arrays++] = counts;
+  }
+  pthread_mutex_unlock(&cpi_site_lock);
+
+  if(counts) {
+    __cpi_site_counts = counts;
+    pthread_setspecific(cpi_site_key, counts);
+  }
+}
+
+static const char *cpi_sites_log; // $CPI_SITES_LOG, read by __cpi_register_sites
+
+// Appends the decimal digits of v to p; returns the end.
+static char *cpi_format_u64(char *p, uint64_t v) {
+  char digits[20];
+  int n = 0;
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while(v);
+  while(n)
+    *p++ = digits[--n];
+  return p;
+}
+
+// Also runs from the signal handler: only async-signal-safe calls, no locks,
+// no stdio. Counters of running threads are read as they are.
+static void cpi_dump_sites() {
+  if(!cpi_num_site_tables)
+    return;
+  int fd = open(cpi_sites_log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+    return;
+
+  char line[512];
+  for(size_t t = 0; t < cpi_num_site_tables; ++t) {
+    cpi_site_table *table = &cpi_site_tables[t];
+    for(uint64_t i = 0; i < table->num_sites; ++i) {
+      uint64_t id = table->base + i, total = cpi_site_sink[id];
+      for(size_t a = 0; a < cpi_num_site_arrays; ++a)
+        total += cpi_site_arrays[a][id];
+      if(!total)
+        continue;
+      char *p = cpi_format_u64(line, total);
+      *p++ = '\t';
+      for(const char *n = table->names[i]; *n && p < line + sizeof(line) - 1; ++n)
+        *p++ = *n;
+      *p++ = '\n';
+      if(write(fd, line, p - line) != p - line)
+        break;
+    }
+  }
+  close(fd);
+}
+
+static void cpi_sites_signal(int sig) {
+  int saved = errno;
+  cpi_dump_sites();
+  errno = saved;
+}
+
+void __cpi_register_sites(const char **names, uint64_t num_sites, uint64_t *base) {
+  pthread_mutex_lock(&cpi_site_lock);
+  if(cpi_num_site_tables == CPI_MAX_SITE_TABLES ||
+     cpi_num_sites + num_sites > CPI_MAX_SITES) {
+    fprintf(stderr, "[cpi] more than %d site counters, rebuild the runtime with a "
+            "larger CPI_MAX_SITES\n", CPI_MAX_SITES);
+    abort();
+  }
+
+  if(!cpi_num_site_tables) {
+    cpi_sites_log = getenv("CPI_SITES_LOG");
+    if(!cpi_sites_log)
+      cpi_sites_log = "prof.cpi_sites.log";
+    pthread_key_create(&cpi_site_key, cpi_site_release);
+    atexit(__cpi_fini);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = cpi_sites_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(CPI_SITES_SIGNAL, &sa, 0);
+  }
+
+  cpi_site_table *table = &cpi_site_tables[cpi_num_site_tables];
+  table->names = names;
+  table->num_sites = num_sites;
+  table->base = cpi_num_sites;
+  *base = cpi_num_sites;
+  cpi_num_sites += num_sites;
+  cpi_num_site_tables++;
+  pthread_mutex_unlock(&cpi_site_lock);
+
+  cpi_site_setup_thread();
+}
+
+// %gs is per thread, so every thread has to point it at the shared table.
+static void cpi_setup_thread() {
+  int res = syscall(SYS_arch_prctl, ARCH_SET_GS, __cpi_table);
+  if(res != 0) {
+    perror("arch_prctl error in cpi.cc");
+  }
+  cpi_site_setup_thread();
+}
+
+// pthread_create is interposed so that a new thread runs cpi_setup_thread
+// before its start routine touches any protected pointer.
+typedef struct {
+  void *(*start)(void *);
+  void *arg;
+} cpi_thread_start;
+
+static void* cpi_thread_trampoline(void *p) {
+  cpi_thread_start ts = *(cpi_thread_start *) p;
+  free(p);
+  cpi_setup_thread();
+  return ts.start(ts.arg);
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start)(void *), void *arg) {
+  static int (*real_pthread_create)(pthread_t *, const pthread_attr_t *,
+                                    void *(*)(void *), void *) = 0;
+  if(!real_pthread_create)
+    real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+
+  // threads started before __cpi_init have nothing to set up
+  if(!__cpi_table)
+    return real_pthread_create(thread, attr, start, arg);
+
+  cpi_thread_start *ts = malloc(sizeof(cpi_thread_start));
+  if(!ts)
+    return EAGAIN;
+  ts->start = start;
+  ts->arg = arg;
+  int res = real_pthread_create(thread, attr, cpi_thread_trampoline, ts);
+  if(res != 0)
+    free(ts);
+  return res;
+}
+
 __CPI_INLINE void __cpi_init() {
-  
+  if(__cpi_table)
+    return;
+  cpi_resolve_hooks();
+
+#ifdef CPI_TWO_LEVEL
+  __cpi_zero_leaf = cpi_map(0, CPI_LEAF_SIZE, PROT_READ);
+  __cpi_pool = cpi_map(0, CPI_DIR_NUM_ENTRIES * CPI_LEAF_SIZE, PROT_READ | PROT_WRITE);
+  __cpi_table = cpi_map((void*) CPI_TABLE_ADDR,
+                CPI_DIR_NUM_ENTRIES * sizeof(void *),
+                PROT_READ | PROT_WRITE);
+
+  cpi_entry **dir = (cpi_entry **) __cpi_table;
+  for(size_t i = 0; i < CPI_DIR_NUM_ENTRIES; ++i)
+    dir[i] = __cpi_zero_leaf;
+#else
   __cpi_table = mmap((void*) CPI_TABLE_ADDR,
                 CPI_TABLE_NUM_ENTRIES * sizeof(cpi_entry),
                 PROT_READ | PROT_WRITE,
@@ -14,14 +369,30 @@ __CPI_INLINE void __cpi_init() {
   if(__cpi_table == (void *) -1) {
     perror("mmap error in cpi.cc");
   }
+#endif
 
-  int res = arch_prctl(ARCH_SET_GS, __cpi_table);
-  if(res != 0) {
-    perror("arch_prctl error in cpi.cc");
-  }
+  cpi_setup_thread();
+  dl_iterate_phdr(cpi_exe_ro_range, 0);
+
+#ifdef CPI_STATS
+  atexit(cpi_print_stats);
+#endif
+}
 
+#ifdef CPI_TWO_LEVEL
+__CPI_INLINE void __cpi_set(void **ptr, void *val) {
+  size_t dir_off = cpi_dir_offset(ptr);
+  cpi_entry *leaf = (cpi_entry *) __CPI_GET(dir_off);
+  if(__builtin_expect(leaf == __cpi_zero_leaf, 0))
+    leaf = cpi_alloc_leaf(dir_off);
+  leaf[cpi_leaf_index(ptr)].data = val;
 }
 
+__CPI_INLINE void* __cpi_get(void **ptr) {
+  cpi_entry *leaf = (cpi_entry *) __CPI_GET(cpi_dir_offset(ptr));
+  return leaf[cpi_leaf_index(ptr)].data;
+}
+#else
 __CPI_INLINE void __cpi_set(void **ptr, void *val) {
   size_t offset = cpi_offset(ptr);
   __CPI_SET(offset, val);
@@ -29,9 +400,283 @@ __CPI_INLINE void __cpi_set(void **ptr, void *val) {
 
 __CPI_INLINE void* __cpi_get(void **ptr) {
   size_t offset = cpi_offset(ptr);
-  return __CPI_GET(offset);
+  return (void *) __CPI_GET(offset);
+}
+#endif
+
+// Bulk shadow propagation.
+//
+// Shadow entries are contiguous for consecutive pointer slots (within one leaf
+// in the two-level layout), so the mem* entry points work on runs of
+// cpi_entry with the libc routines, which are vectorized already. Runs are
+// handled a shadow page at a time so that copying or clearing a large buffer
+// that holds no code pointers does not fault in shadow pages for nothing.
+
+#define CPI_PAGE_ENTRIES (4096 / sizeof(cpi_entry))
+
+static cpi_entry* cpi_entry_at(size_t addr, int alloc) {
+#ifdef CPI_TWO_LEVEL
+  size_t dir_off = cpi_dir_offset(addr);
+  cpi_entry *leaf = *(cpi_entry **) ((char *) __cpi_table + dir_off);
+  if(alloc && leaf == __cpi_zero_leaf)
+    leaf = cpi_alloc_leaf(dir_off);
+  return leaf + cpi_leaf_index(addr);
+#else
+  return (cpi_entry *) ((char *) __cpi_table + cpi_offset(addr));
+#endif
+}
+
+// entries from addr up to the end of its contiguous run: of its leaf in the
+// two-level layout, of the table in the flat one, whose offsets wrap at
+// CPI_ADDR_MASK
+static size_t cpi_contiguous_left(size_t addr) {
+#ifdef CPI_TWO_LEVEL
+  return CPI_LEAF_NUM_ENTRIES - cpi_leaf_index(addr);
+#else
+  return CPI_TABLE_NUM_ENTRIES - ((addr & CPI_ADDR_MASK) >> 3);
+#endif
+}
+
+// entries from addr up to the end of its contiguous run and of its page
+static size_t cpi_run_left(size_t addr) {
+  size_t left = CPI_PAGE_ENTRIES - (cpi_leaf_index(addr) % CPI_PAGE_ENTRIES);
+  size_t contiguous_left = cpi_contiguous_left(addr);
+  if(contiguous_left < left)
+    left = contiguous_left;
+  return left;
+}
+
+static int cpi_entries_zero(const cpi_entry *e, size_t n) {
+  size_t acc = 0;
+  for(size_t i = 0; i < n; ++i)
+    acc |= (size_t) e[i].data;
+  return acc == 0;
+}
+
+// clear the entries of the pointer slots [addr, addr + 8 * n)
+static void cpi_clear_slots(size_t addr, size_t n) {
+  while(n) {
+    size_t run = cpi_run_left(addr);
+    if(run > n)
+      run = n;
+    // never writes to the zero leaf, it only holds zeroes
+    cpi_entry *e = cpi_entry_at(addr, 0);
+    if(!cpi_entries_zero(e, run))
+      memset(e, 0, run * sizeof(cpi_entry));
+    addr += run * sizeof(void *);
+    n -= run;
+  }
+}
+
+// copy the entries of n pointer slots from src to dst
+static void cpi_copy_slots(size_t dst, size_t src, size_t n) {
+  // overlapping ranges (memmove within one object) are copied in one go
+  if(dst < src + n * sizeof(void *) && src < dst + n * sizeof(void *)) {
+    for(size_t i = 0; i < n; ++i) {
+      size_t k = dst > src ? n - 1 - i : i;
+      cpi_entry *d = cpi_entry_at(dst + k * sizeof(void *), 1);
+      *d = *cpi_entry_at(src + k * sizeof(void *), 0);
+    }
+    return;
+  }
+
+  while(n) {
+    size_t run = cpi_run_left(dst);
+    size_t src_run = cpi_run_left(src);
+    if(src_run < run)
+      run = src_run;
+    if(run > n)
+      run = n;
+
+    cpi_entry *s = cpi_entry_at(src, 0);
+    if(cpi_entries_zero(s, run))
+      cpi_clear_slots(dst, run);
+    else
+      memcpy(cpi_entry_at(dst, 1), s, run * sizeof(cpi_entry));
+
+    dst += run * sizeof(void *);
+    src += run * sizeof(void *);
+    n -= run;
+  }
+}
+
+// A slot that the operation only partly overwrites no longer holds the
+// pointer its entry describes, so the entries of the edge slots are cleared.
+// Fully covered slots get the source entries when src and dst are equally
+// aligned and are cleared otherwise.
+static void cpi_move_shadow(void *dst, const void *src, size_t n) {
+  size_t d = (size_t) dst, s = (size_t) src;
+  size_t first = (d + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  size_t last = (d + n) & ~(sizeof(void *) - 1);
+
+  if(n == 0)
+    return;
+  if(first != d)
+    cpi_clear_slots(d & ~(sizeof(void *) - 1), 1);
+  if(last != d + n && last >= first)
+    cpi_clear_slots(last, 1);
+  if(last <= first)
+    return;
+
+  size_t slots = (last - first) / sizeof(void *);
+  if(src && ((d - s) & (sizeof(void *) - 1)) == 0)
+    cpi_copy_slots(first, s + (first - d), slots);
+  else
+    cpi_clear_slots(first, slots);
+}
+
+void* __cpi_memcpy(void *dst, const void *src, size_t n) {
+  memcpy(dst, src, n);
+  cpi_move_shadow(dst, src, n);
+  return dst;
+}
+
+void* __cpi_memmove(void *dst, const void *src, size_t n) {
+  memmove(dst, src, n);
+  cpi_move_shadow(dst, src, n);
+  return dst;
+}
+
+void* __cpi_memset(void *dst, int c, size_t n) {
+  memset(dst, c, n);
+  cpi_move_shadow(dst, 0, n);
+  return dst;
+}
+
+// Shadow reclamation.
+//
+// free, realloc and munmap are interposed so that the entries of released
+// memory are cleared: a stale entry would otherwise keep validating a
+// pointer value that is long gone, and the shadow of a churning heap would
+// only ever grow. Shadow pages that the released range covers completely
+// are dropped with MADV_DONTNEED, which zeroes them and returns their memory.
+
+static void (*real_free)(void *) = 0;
+static void* (*real_realloc)(void *, size_t) = 0;
+static int (*real_munmap)(void *, size_t) = 0;
+
+static pthread_once_t cpi_hooks_once = PTHREAD_ONCE_INIT;
+static __thread int cpi_resolving = 0;
+
+static void cpi_resolve_hooks_once() {
+  cpi_resolving = 1;
+  real_free = dlsym(RTLD_NEXT, "free");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  real_munmap = dlsym(RTLD_NEXT, "munmap");
+  cpi_resolving = 0;
+}
+
+// Resolves the hooks once; other threads wait for them. Returns 0 in the
+// thread that is resolving them: dlsym may allocate and free, and the calls
+// that reach us meanwhile have to do without.
+static int cpi_resolve_hooks() {
+  if(cpi_resolving)
+    return 0;
+  pthread_once(&cpi_hooks_once, cpi_resolve_hooks_once);
+  return 1;
+}
+
+// clear the entries [e, e + n), dropping the shadow pages fully inside
+static void cpi_reclaim_entries(cpi_entry *e, size_t n) {
+  size_t lo = (size_t) e, hi = (size_t) (e + n);
+  size_t plo = (lo + 4095) & ~4095ul, phi = hi & ~4095ul;
+  if(phi <= plo) {
+    if(!cpi_entries_zero(e, n))
+      memset(e, 0, n * sizeof(cpi_entry));
+    return;
+  }
+
+  if(plo != lo && !cpi_entries_zero(e, (plo - lo) / sizeof(cpi_entry)))
+    memset(e, 0, plo - lo);
+  if(hi != phi && !cpi_entries_zero((cpi_entry *) phi, (hi - phi) / sizeof(cpi_entry)))
+    memset((void *) phi, 0, hi - phi);
+
+  unsigned char resident[256];
+  size_t pages = 0;
+  for(size_t p = plo; p < phi; p += sizeof(resident) * 4096) {
+    size_t len = phi - p < sizeof(resident) * 4096 ? phi - p : sizeof(resident) * 4096;
+    if(mincore((void *) p, len, resident) == 0)
+      for(size_t i = 0; i < len / 4096; ++i)
+        pages += resident[i] & 1;
+  }
+  if(pages) {
+    madvise((void *) plo, phi - plo, MADV_DONTNEED);
+    __sync_fetch_and_add(&__cpi_stats.reclaimed, pages * 4096);
+  }
+}
+
+// clear the entries of every pointer slot inside [addr, addr + len)
+static void cpi_reclaim(void *addr, size_t len) {
+  size_t first = ((size_t) addr + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  size_t last = ((size_t) addr + len) & ~(sizeof(void *) - 1);
+  if(!__cpi_table || last <= first)
+    return;
+
+  __sync_fetch_and_add(&__cpi_stats.frees, 1);
+  // one contiguous run at a time: a leaf, or the flat table up to where its
+  // offsets wrap; leaves never written are the shared zero leaf
+  while(first < last) {
+    size_t n = cpi_contiguous_left(first);
+    if(n > (last - first) / sizeof(void *))
+      n = (last - first) / sizeof(void *);
+    cpi_entry *e = cpi_entry_at(first, 0);
+#ifdef CPI_TWO_LEVEL
+    if(e - cpi_leaf_index(first) != __cpi_zero_leaf)
+#endif
+      cpi_reclaim_entries(e, n);
+    first += n * sizeof(void *);
+  }
+}
+
+void free(void *ptr) {
+  // a free from within dlsym is dropped
+  if(!cpi_resolve_hooks() || !ptr)
+    return;
+  // clear before the block can be handed out again
+  cpi_reclaim(ptr, malloc_usable_size(ptr));
+  real_free(ptr);
+}
+
+// The shadow of the block is always updated before the block goes back to
+// libc: once released, another thread may get the memory and set entries in
+// it. A shrinking block loses its tail first; a growing one is moved by
+// hand, so that its entries are copied while the old block is still ours.
+void* realloc(void *ptr, size_t size) {
+  int resolved = cpi_resolve_hooks();
+  if(!ptr)
+    return malloc(size);
+  size_t old_size = malloc_usable_size(ptr);
+
+  if(size <= old_size) {
+    if(!resolved)
+      return ptr;
+    cpi_reclaim((char *) ptr + size, old_size - size);
+    void *nptr = real_realloc(ptr, size);
+    // glibc shrinks in place; an allocator that moves the block has already
+    // released it, and its entries are copied as they are
+    if(nptr && nptr != ptr && __cpi_table)
+      cpi_move_shadow(nptr, ptr, size);
+    return nptr;
+  }
+
+  void *nptr = malloc(size);
+  if(!nptr)
+    return 0;
+  memcpy(nptr, ptr, old_size);
+  // the pointers moved with the data; their entries follow them
+  if(__cpi_table)
+    cpi_move_shadow(nptr, ptr, old_size);
+  free(ptr);
+  return nptr;
+}
+
+int munmap(void *addr, size_t len) {
+  if(!cpi_resolve_hooks())
+    return syscall(SYS_munmap, addr, len);
+  cpi_reclaim(addr, len);
+  return real_munmap(addr, len);
 }
 
 __CPI_INLINE void __cpi_fini() {
-  
+  cpi_dump_sites();
 }
@@ -15,13 +15,33 @@
 #define CPI_ADDR_MASK (0xfffffffff8ull)
 #define CPI_TABLE_ADDR (1ull << 45)
 #define entry_size_n (sizeof(cpi_entry) / sizeof(void *))
+#ifndef __CPI_INLINE
 # define __CPI_INLINE __attribute__((always_inline)) __attribute__((weak)) __attribute__ ((visibility ("hidden")))
+#endif
 
 typedef struct {
   void* data;
   void* id;
 } cpi_entry;
 
+// Two-level layout (build with -DCPI_TWO_LEVEL).
+// %gs points at a directory of leaf pointers instead of the flat table.
+// Every directory slot starts out pointing at one shared read-only zero leaf,
+// so a lookup is always two dependent loads and never branches. A store that
+// hits the zero leaf carves a real leaf out of the leaf pool first.
+#define CPI_LEAF_BITS 20
+#define CPI_LEAF_NUM_ENTRIES (1ull << CPI_LEAF_BITS)
+#define CPI_LEAF_SIZE (CPI_LEAF_NUM_ENTRIES * sizeof(cpi_entry))
+#define CPI_DIR_NUM_ENTRIES (CPI_TABLE_NUM_ENTRIES >> CPI_LEAF_BITS)
+
+typedef struct {
+  size_t leaves;       // leaves carved out of the pool
+  size_t leaf_races;   // leaves lost to a concurrent allocation
+  size_t frees;        // free/realloc/munmap calls whose shadow was cleared
+  size_t reclaimed;    // resident shadow bytes handed back with MADV_DONTNEED
+} cpi_stats;
+
+extern cpi_stats __cpi_stats;
 
 __CPI_INLINE void __cpi_init();
 __CPI_INLINE void __cpi_fini();
@@ -29,11 +49,45 @@ __CPI_INLINE void __cpi_fini();
 __CPI_INLINE void __cpi_set(void **ptr, void *val);
 __CPI_INLINE void* __cpi_get(void **ptr);
 
+// memcpy/memmove/memset that carry the shadow entries of the range along
+void* __cpi_memcpy(void *dst, const void *src, size_t n);
+void* __cpi_memmove(void *dst, const void *src, size_t n);
+void* __cpi_memset(void *dst, int c, size_t n);
+
+// resident bytes of the shadow table (or 0 if unknown)
+size_t __cpi_shadow_rss();
+
+// Vtable range check (opt -cpi-vtable-check). A vtable pointer passes the
+// inlined check if vptr - __cpi_vtable_start < __cpi_vtable_size, the
+// read-only data of the executable; anything else goes to __cpi_vtable_check,
+// which accepts the read-only data of every loaded object and aborts otherwise.
+extern uintptr_t __cpi_vtable_start;
+extern uintptr_t __cpi_vtable_size;
+void __cpi_vtable_check(void *vptr);
+
+// Per-site counters (opt -cpi-site-counters). Each instrumented module
+// registers its site names in a constructor and gets the index of its first
+// counter in *base; a site bumps __cpi_site_counts[*base + id] of the running
+// thread. The counts are written to $CPI_SITES_LOG (prof.cpi_sites.log) by
+// __cpi_fini and on CPI_SITES_SIGNAL, one "count<TAB>site" line per hit site.
+#define CPI_MAX_SITES (1 << 20)
+#define CPI_MAX_SITE_TABLES 256
+#define CPI_MAX_SITE_ARRAYS 4096
+#ifndef CPI_SITES_SIGNAL
+# define CPI_SITES_SIGNAL SIGUSR2
+#endif
+
+extern __thread uint64_t *__cpi_site_counts;
+void __cpi_register_sites(const char **names, uint64_t num_sites, uint64_t *base);
+
+// An indirect call checked against its closed set of targets missed them all.
+void __cpi_bad_call(void *target) __attribute__((noreturn));
+
 // assembly
 
 #define __CPI_SET(off, val) \
   __asm__ __volatile__ ("movq %0, %%gs: (%1)" : \
-                          : "ir" (val), \
+                          : "r" (val), \
                           "r" (off));
 #define __CPI_GET(off) \
   ({ size_t val; \
@@ -42,6 +96,12 @@ __CPI_INLINE void* __cpi_get(void **ptr);
                           : "r" (off)); \
    val; })
 
-// 
+//
 #define cpi_offset(address) \
   ((((size_t)(address)) & CPI_ADDR_MASK) * entry_size_n)
+
+// two-level: byte offset of the directory slot, index inside the leaf
+#define cpi_dir_offset(address) \
+  (((((size_t)(address)) & CPI_ADDR_MASK) >> (CPI_LEAF_BITS + 3)) * sizeof(void *))
+#define cpi_leaf_index(address) \
+  ((((size_t)(address)) >> 3) & (CPI_LEAF_NUM_ENTRIES - 1))
@@ -0,0 +1,219 @@
+/****
+ * objarena.cpp
+ *
+ * Runtime of opt -objarena (see objarena.h). The arenas are slices of
+ * ARENA_SPAN bytes of one reservation, made on the first allocation with
+ * MAP_NORESERVE, so that a pointer is an arena object iff it is inside the
+ * reservation, and its arena is its offset / ARENA_SPAN. The size class of
+ * every object is kept for objArenaFree in one byte per 16-byte granule of
+ * a second reservation. An arena allocates under its own lock: a pop of the
+ * free list of the class, or else a bump.
+ *
+ * Build with "make OBJARENA_STATS=1" to print the use of each arena at exit.
+ ****/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <atomic>
+
+#include "objarena.h"
+
+#ifndef ARENA_SPAN_SHIFT
+#define ARENA_SPAN_SHIFT 30 // address space of an arena
+#endif
+#define ARENA_SPAN (1ul << ARENA_SPAN_SHIFT)
+#define SLAB_SIZE (1ul << 16)
+#define GRANULE_SHIFT 4 // malloc's alignment
+
+// Size classes: 16-byte steps up to 256 bytes, then powers of two up to
+// OBJARENA_MAX_OBJECT. Class 0 is unused.
+#define SMALL_CLASSES 16
+#define NUM_CLASSES (SMALL_CLASSES + 8)
+
+struct Arena {
+  pthread_mutex_t lock;
+  uint32_t id;                  // of the last allocation, for objArenaRealloc
+  char *start, *top, *end;      // bump pointer of the arena
+  char *slab[NUM_CLASSES];      // slab arenas: bump pointer of each class
+  char *slabEnd[NUM_CLASSES];
+  void *freeList[NUM_CLASSES];  // freed objects, linked through their first word
+  uint64_t allocs, frees, fallbacks;
+};
+
+static Arena Arenas[OBJARENA_MAX];
+static uintptr_t Base;
+static std::atomic<uintptr_t> Limit(0); // size of the reservation, 0 until it is made
+static uint8_t *Classes;                // class of the object at each granule
+static pthread_once_t Reserved = PTHREAD_ONCE_INIT;
+
+static unsigned sizeClass (size_t size) {
+  if (size <= 256)
+    return size ? (size + 15) >> 4 : 1;
+  unsigned c = SMALL_CLASSES + 1;
+  for (size_t s = 512; s < size; s <<= 1)
+    ++c;
+  return c;
+}
+
+static size_t classSize (unsigned c) {
+  return c <= SMALL_CLASSES ? (size_t) c << 4 : 256ul << (c - SMALL_CLASSES);
+}
+
+static void reserve () {
+  size_t span = (size_t) OBJARENA_MAX << ARENA_SPAN_SHIFT;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  void *arenas = mmap(NULL, span, PROT_READ | PROT_WRITE, flags, -1, 0);
+  void *classes = mmap(NULL, span >> GRANULE_SHIFT, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (arenas == MAP_FAILED || classes == MAP_FAILED) {
+    perror("objarena: cannot reserve the arenas, using malloc");
+    if (arenas != MAP_FAILED)
+      munmap(arenas, span);
+    if (classes != MAP_FAILED)
+      munmap(classes, span >> GRANULE_SHIFT);
+    return;
+  }
+
+  for (unsigned i = 0; i < OBJARENA_MAX; ++i) {
+    Arena &a = Arenas[i];
+    pthread_mutex_init(&a.lock, NULL);
+    a.start = a.top = static_cast<char*>(arenas) + i * ARENA_SPAN;
+    a.end = a.start + ARENA_SPAN;
+  }
+  Classes = static_cast<uint8_t*>(classes);
+  Base = reinterpret_cast<uintptr_t>(arenas);
+  Limit.store(span, std::memory_order_release);
+}
+
+static char *bump (char *&top, char *end, size_t size) {
+  if ((size_t) (end - top) < size)
+    return NULL;
+  char *p = top;
+  top += size;
+  return p;
+}
+
+// NULL if the object is not for the arenas, or does not fit any more.
+static void *arenaAlloc (size_t size, uint32_t id) {
+  uint32_t index = id & ~OBJARENA_SLAB;
+  if (index >= OBJARENA_MAX)
+    return NULL;
+  pthread_once(&Reserved, reserve);
+  if (!Limit.load(std::memory_order_acquire))
+    return NULL;
+
+  Arena &a = Arenas[index];
+  pthread_mutex_lock(&a.lock);
+  a.id = id;
+  char *p = NULL;
+  unsigned c = size <= OBJARENA_MAX_OBJECT ? sizeClass(size) : 0;
+  if (c && a.freeList[c]) {
+    p = static_cast<char*>(a.freeList[c]);
+    a.freeList[c] = *reinterpret_cast<void**>(p);
+  } else if (c && !(id & OBJARENA_SLAB)) {
+    p = bump(a.top, a.end, classSize(c));
+  } else if (c) {
+    if ((size_t) (a.slabEnd[c] - a.slab[c]) < classSize(c)) {
+      char *slab = bump(a.top, a.end, SLAB_SIZE);
+      if (slab) {
+        a.slab[c] = slab;
+        a.slabEnd[c] = slab + SLAB_SIZE;
+      }
+    }
+    p = bump(a.slab[c], a.slabEnd[c], classSize(c));
+  }
+  if (p) {
+    Classes[(reinterpret_cast<uintptr_t>(p) - Base) >> GRANULE_SHIFT] = c;
+    ++a.allocs;
+  } else {
+    ++a.fallbacks;
+  }
+  pthread_mutex_unlock(&a.lock);
+  return p;
+}
+
+extern "C" void*
+objArenaMalloc (size_t size, uint32_t arena){
+  void *addr = arenaAlloc(size, arena);
+  return addr ? addr : malloc(size);
+}
+
+extern "C" void*
+objArenaCalloc (size_t num, size_t size, uint32_t arena){
+  if (size && num > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  void *addr = arenaAlloc(num * size, arena);
+  if (!addr)
+    return calloc(num, size);
+  memset(addr, 0, num * size); // freed objects are reused
+  return addr;
+}
+
+extern "C" void
+objArenaFree (void *addr){
+  uintptr_t limit = Limit.load(std::memory_order_acquire);
+  uintptr_t offset = reinterpret_cast<uintptr_t>(addr) - Base;
+  if (offset >= limit) {
+    free(addr);
+    return;
+  }
+
+  Arena &a = Arenas[offset >> ARENA_SPAN_SHIFT];
+  pthread_mutex_lock(&a.lock);
+  unsigned c = Classes[offset >> GRANULE_SHIFT];
+  *static_cast<void**>(addr) = a.freeList[c];
+  a.freeList[c] = addr;
+  ++a.frees;
+  pthread_mutex_unlock(&a.lock);
+}
+
+extern "C" void*
+objArenaRealloc (void *addr, size_t size, uint32_t arena){
+  if (!addr)
+    return objArenaMalloc(size, arena);
+  uintptr_t limit = Limit.load(std::memory_order_acquire);
+  uintptr_t offset = reinterpret_cast<uintptr_t>(addr) - Base;
+  if (offset >= limit)
+    return realloc(addr, size);
+  if (!size) {
+    objArenaFree(addr);
+    return NULL;
+  }
+
+  size_t old = classSize(Classes[offset >> GRANULE_SHIFT]);
+  if (size <= old)
+    return addr;
+  Arena &a = Arenas[offset >> ARENA_SPAN_SHIFT];
+  pthread_mutex_lock(&a.lock);
+  uint32_t id = a.id;
+  pthread_mutex_unlock(&a.lock);
+  void *naddr = objArenaMalloc(size, id);
+  if (naddr) {
+    memcpy(naddr, addr, old);
+    objArenaFree(addr);
+  }
+  return naddr;
+}
+
+extern "C" void*
+objArenaReallocNone (void *addr, size_t size){
+  return objArenaRealloc(addr, size, OBJARENA_NONE);
+}
+
+#ifdef OBJARENA_STATS
+__attribute__((destructor))
+static void printStats () {
+  for (unsigned i = 0; i < OBJARENA_MAX; ++i) {
+    Arena &a = Arenas[i];
+    if (!a.allocs && !a.fallbacks)
+      continue;
+    fprintf(stderr, "objarena: arena %u (%s): %lu objects, %lu freed, %lu to malloc, %lu bytes carved\n",
+            i, a.id & OBJARENA_SLAB ? "slab" : "bump", a.allocs, a.frees, a.fallbacks,
+            (unsigned long) (a.top - a.start));
+  }
+}
+#endif
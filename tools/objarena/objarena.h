@@ -0,0 +1,47 @@
+#ifndef LLVM_CORELAB_OBJARENA_RUNTIME_H
+#define LLVM_CORELAB_OBJARENA_RUNTIME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/****
+ * objarena.h
+ *
+ * Allocation-site arenas (opt -objarena): malloc and calloc calls of the
+ * sites of an arena plan allocate from the arena of their group, so that
+ * objects accessed together share cache lines and pages. Every free and
+ * realloc of the program goes through objArenaFree and objArenaRealloc,
+ * which pass pointers outside the arenas on to libc. So do calls through
+ * the address of free or realloc; a library built without the pass still
+ * calls the free of libc.
+ *
+ * An arena id is the group of the plan, with OBJARENA_SLAB set for slab
+ * arenas: a bump arena carves every object from one bump pointer, in
+ * allocation order; a slab arena carves the objects of each size class from
+ * slabs of their own. Both reuse freed objects of the same size class.
+ * Objects larger than OBJARENA_MAX_OBJECT, ids of OBJARENA_MAX and above,
+ * and allocations that no longer fit in their arena come from malloc.
+ ****/
+
+#define OBJARENA_MAX 64                // arenas
+#define OBJARENA_MAX_OBJECT 32768      // bytes
+#define OBJARENA_SLAB 0x80000000u      // arena id flag
+#define OBJARENA_NONE 0xffffffffu      // objArenaRealloc of a site without arena
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *objArenaMalloc (size_t size, uint32_t arena);
+void *objArenaCalloc (size_t num, size_t size, uint32_t arena);
+// Moves an arena object within its arena; addr NULL allocates from arena.
+void *objArenaRealloc (void *addr, size_t size, uint32_t arena);
+// realloc for pointers to realloc taken by the program: no planned site.
+void *objArenaReallocNone (void *addr, size_t size);
+void objArenaFree (void *addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,315 @@
+/****
+ * objtrace-analyze.cpp
+ *
+ * Streams an ObjTrace trace (or dependence profile) and reports, per
+ * allocation site, how much memory it holds and how hot it is, and the
+ * load/store instructions that touch each site.
+ *
+ *   allocs       objects allocated at the site during the trace
+ *   bytes        bytes allocated
+ *   peak/live    most bytes live at once / still live at the end
+ *   life avg/max lifetime of the freed objects, in microseconds
+ *   loads/stores accesses to the site's objects
+ *
+ * Chunks of different threads are not ordered in the file, so an object
+ * freed by another thread than the one that allocated it can be seen freed
+ * before it is allocated; such frees are counted as unmatched.
+ *
+ * With -a, also writes the arena plan of opt -objarena: the sites that take
+ * HOT_FRACTION of the accesses, grouped with the sites they are accessed
+ * together with, one line "arena bump|slab site" per site. Two sites are
+ * accessed together as often as an access to one directly follows an access
+ * to the other in a thread (trace), or as the accesses of the instructions
+ * that touch both (dependence profile); they share an arena when that is at
+ * least AFFINITY_FRACTION of the accesses of the colder one. Arenas of one
+ * site are slab arenas, the others bump arenas, so that objects of
+ * different sites interleave in allocation order.
+ *
+ * Needs the zlib of the system (headers and library) to read deflated
+ * traces.
+ *
+ * usage: objtrace-analyze [-n top] [-a prof.objtrace.arenas]
+ *                         [prof.objtrace.bin | prof.objtrace.deps]
+ ****/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <zlib.h>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "../objtraceformat.h"
+#include "../../objarena/objarena.h"
+
+#define HOT_FRACTION 0.9
+#define AFFINITY_FRACTION 0.125
+
+struct SiteStats {
+  uint64_t allocs, bytes, live, peak, freed, lifeSum, lifeMax, loads, stores;
+};
+
+struct LiveObject {
+  FullID site;
+  uint64_t size;
+  uint64_t time;
+};
+
+struct EdgeStats {
+  uint64_t loads, stores;
+};
+
+typedef std::pair<FullID, FullID> Edge; // instruction, allocation site
+typedef std::pair<FullID, FullID> SitePair; // smaller FullID first
+
+static std::map<FullID, SiteStats> Sites;
+static std::map<Edge, EdgeStats> Edges;
+static std::map<SitePair, uint64_t> Affinity;
+static std::unordered_map<uint64_t, LiveObject> Live;
+static FullID LastSite; // of the last access of the chunk
+static bool HaveLast;
+static uint64_t Events, Chunks, Unmatched, FileBytes, RawBytes;
+
+static void analyze (const TraceEvent &e) {
+  SiteStats &site = Sites[e.allocFullId];
+  switch (e.kind) {
+  case TraceLoad:
+  case TraceStore: {
+    EdgeStats &edge = Edges[Edge(e.instrFullId, e.allocFullId)];
+    ++(e.kind == TraceStore ? edge.stores : edge.loads);
+    ++(e.kind == TraceStore ? site.stores : site.loads);
+    if (HaveLast && LastSite != e.allocFullId)
+      ++Affinity[SitePair(std::min(LastSite, e.allocFullId), std::max(LastSite, e.allocFullId))];
+    LastSite = e.allocFullId;
+    HaveLast = true;
+    break;
+  }
+  case TraceAlloc:
+    ++site.allocs;
+    site.bytes += e.size;
+    site.live += e.size;
+    site.peak = std::max(site.peak, site.live);
+    Live[e.addr] = {e.allocFullId, e.size, e.time};
+    break;
+  case TraceFree: {
+    auto it = Live.find(e.addr);
+    if (it == Live.end()) {
+      ++Unmatched;
+      break;
+    }
+    SiteStats &owner = Sites[it->second.site];
+    uint64_t life = e.time - it->second.time;
+    owner.live -= it->second.size;
+    ++owner.freed;
+    owner.lifeSum += life;
+    owner.lifeMax = std::max(owner.lifeMax, life);
+    Live.erase(it);
+    break;
+  }
+  }
+}
+
+static bool readTrace (FILE *in) {
+  std::vector<uint8_t> buf, raw;
+  TraceChunk chunk;
+  while (fread(&chunk, sizeof(chunk), 1, in) == 1) {
+    buf.resize(chunk.size);
+    if (fread(buf.data(), 1, chunk.size, in) != chunk.size) {
+      fprintf(stderr, "objtrace-analyze: truncated chunk\n");
+      return false;
+    }
+    const uint8_t *p = buf.data();
+    if (chunk.size != chunk.rawSize) {
+      raw.resize(chunk.rawSize);
+      uLongf size = chunk.rawSize;
+      if (uncompress(raw.data(), &size, buf.data(), chunk.size) != Z_OK || size != chunk.rawSize) {
+        fprintf(stderr, "objtrace-analyze: corrupt chunk\n");
+        return false;
+      }
+      p = raw.data();
+    }
+
+    const uint8_t *end = p + chunk.rawSize;
+    TraceCodec codec;
+    TraceEvent e;
+    HaveLast = false;
+    for (uint32_t i = 0; i < chunk.count; ++i) {
+      if (!codec.decode(p, end, e)) {
+        fprintf(stderr, "objtrace-analyze: corrupt event\n");
+        return false;
+      }
+      analyze(e);
+    }
+    ++Chunks;
+    Events += chunk.count;
+    FileBytes += sizeof(chunk) + chunk.size;
+    RawBytes += sizeof(chunk) + chunk.rawSize;
+  }
+  return true;
+}
+
+static bool readDeps (FILE *in) {
+  DepEntry d;
+  while (fread(&d, sizeof(d), 1, in) == 1) {
+    Edges[Edge(d.instrFullId, d.allocFullId)] = {d.loads, d.stores};
+    SiteStats &site = Sites[d.allocFullId];
+    site.loads += d.loads;
+    site.stores += d.stores;
+    Events += d.loads + d.stores;
+  }
+
+  // entries are sorted by instruction
+  for (auto i = Edges.begin(); i != Edges.end(); ++i)
+    for (auto j = std::next(i); j != Edges.end() && j->first.first == i->first.first; ++j)
+      Affinity[SitePair(i->first.second, j->first.second)] +=
+        std::min(i->second.loads + i->second.stores, j->second.loads + j->second.stores);
+  return true;
+}
+
+static void report (size_t top, bool trace) {
+  if (trace)
+    printf("%" PRIu64 " events in %" PRIu64 " chunks, %" PRIu64 " bytes (%" PRIu64 " before zlib), "
+           "%" PRIu64 " unmatched frees\n\n", Events, Chunks, FileBytes, RawBytes, Unmatched);
+
+  std::vector<std::pair<FullID, SiteStats> > sites(Sites.begin(), Sites.end());
+  std::sort(sites.begin(), sites.end(), [](const std::pair<FullID, SiteStats> &a,
+                                           const std::pair<FullID, SiteStats> &b) {
+    return a.second.loads + a.second.stores > b.second.loads + b.second.stores;
+  });
+  printf("%20s %10s %12s %12s %12s %10s %10s %12s %12s\n", "site", "allocs", "bytes", "peak",
+         "live", "life avg", "life max", "loads", "stores");
+  for (size_t i = 0; i < sites.size() && i < top; ++i) {
+    const SiteStats &s = sites[i].second;
+    printf("%20" PRIu64 " %10" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %10.1f %10.1f %12" PRIu64 " %12" PRIu64 "\n",
+           sites[i].first, s.allocs, s.bytes, s.peak, s.live,
+           s.freed ? s.lifeSum / 1e3 / s.freed : 0.0, s.lifeMax / 1e3, s.loads, s.stores);
+  }
+
+  std::vector<std::pair<Edge, EdgeStats> > edges(Edges.begin(), Edges.end());
+  std::sort(edges.begin(), edges.end(), [](const std::pair<Edge, EdgeStats> &a,
+                                           const std::pair<Edge, EdgeStats> &b) {
+    return a.second.loads + a.second.stores > b.second.loads + b.second.stores;
+  });
+  printf("\n%20s %20s %12s %12s\n", "instruction", "site", "loads", "stores");
+  for (size_t i = 0; i < edges.size() && i < top; ++i)
+    printf("%20" PRIu64 " %20" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n", edges[i].first.first,
+           edges[i].first.second, edges[i].second.loads, edges[i].second.stores);
+}
+
+static FullID findGroup (std::map<FullID, FullID> &group, FullID site) {
+  while (group[site] != site)
+    site = group[site] = group[group[site]];
+  return site;
+}
+
+static bool writePlan (const char *path) {
+  uint64_t total = 0;
+  std::vector<std::pair<uint64_t, FullID> > byAccesses;
+  for (auto &site : Sites) {
+    total += site.second.loads + site.second.stores;
+    // objects that big come from malloc anyway
+    if (site.second.allocs && site.second.bytes / site.second.allocs > OBJARENA_MAX_OBJECT)
+      continue;
+    if (site.second.loads + site.second.stores)
+      byAccesses.push_back(std::make_pair(site.second.loads + site.second.stores, site.first));
+  }
+  std::sort(byAccesses.rbegin(), byAccesses.rend());
+
+  std::map<FullID, FullID> group; // hot site -> another site of its group
+  uint64_t covered = 0;
+  for (size_t i = 0; i < byAccesses.size() && covered < HOT_FRACTION * total; ++i) {
+    group[byAccesses[i].second] = byAccesses[i].second;
+    covered += byAccesses[i].first;
+  }
+
+  std::vector<std::pair<uint64_t, SitePair> > pairs;
+  for (auto &pair : Affinity)
+    if (group.count(pair.first.first) && group.count(pair.first.second))
+      pairs.push_back(std::make_pair(pair.second, pair.first));
+  std::sort(pairs.rbegin(), pairs.rend());
+  for (auto &pair : pairs) {
+    const SiteStats &a = Sites[pair.second.first], &b = Sites[pair.second.second];
+    uint64_t colder = std::min(a.loads + a.stores, b.loads + b.stores);
+    if (pair.first >= AFFINITY_FRACTION * colder)
+      group[findGroup(group, pair.second.first)] = findGroup(group, pair.second.second);
+  }
+
+  // arenas in order of accesses
+  std::map<FullID, std::pair<uint64_t, std::vector<FullID> > > groups;
+  for (auto &site : group) {
+    auto &g = groups[findGroup(group, site.first)];
+    g.first += Sites[site.first].loads + Sites[site.first].stores;
+    g.second.push_back(site.first);
+  }
+  std::vector<std::pair<uint64_t, std::vector<FullID> > > arenas;
+  for (auto &g : groups)
+    arenas.push_back(g.second);
+  std::stable_sort(arenas.begin(), arenas.end(),
+                   [](const std::pair<uint64_t, std::vector<FullID> > &a,
+                      const std::pair<uint64_t, std::vector<FullID> > &b) {
+                     return a.first > b.first;
+                   });
+
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    perror(path);
+    return false;
+  }
+  fprintf(out, "# objtrace arena plan: arena bump|slab site\n");
+  for (size_t i = 0; i < arenas.size() && i < OBJARENA_MAX; ++i) {
+    fprintf(out, "# arena %zu: %" PRIu64 " accesses\n", i, arenas[i].first);
+    for (FullID site : arenas[i].second)
+      fprintf(out, "%zu %s %" PRIu64 "\n", i, arenas[i].second.size() > 1 ? "bump" : "slab", site);
+  }
+  fclose(out);
+  return true;
+}
+
+int main (int argc, char **argv) {
+  size_t top = 20;
+  const char *planPath = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:a:")) != -1) {
+    if (opt == 'n') {
+      top = strtoul(optarg, NULL, 0);
+    } else if (opt == 'a') {
+      planPath = optarg;
+    } else {
+      fprintf(stderr, "usage: %s [-n top] [-a prof.objtrace.arenas] "
+                      "[prof.objtrace.bin | prof.objtrace.deps]\n", argv[0]);
+      return 1;
+    }
+  }
+  const char *path = optind < argc ? argv[optind] : "prof.objtrace.bin";
+  FILE *in = fopen(path, "rb");
+  if (!in) {
+    perror(path);
+    return 1;
+  }
+
+  TraceHeader header;
+  bool ok;
+  bool trace = false;
+  if (fread(&header, sizeof(header), 1, in) != 1) {
+    ok = false;
+  } else if (!memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) &&
+             header.version == TRACE_VERSION) {
+    trace = true;
+    ok = readTrace(in);
+  } else if (!memcmp(header.magic, DEPS_MAGIC, sizeof(DEPS_MAGIC)) &&
+             header.version == DEPS_VERSION && header.recordSize == sizeof(DepEntry)) {
+    ok = readDeps(in);
+  } else {
+    fprintf(stderr, "%s: not an ObjTrace trace or profile of this version\n", path);
+    ok = false;
+  }
+  fclose(in);
+  if (ok)
+    report(top, trace);
+  if (ok && planPath)
+    ok = writePlan(planPath);
+  return ok ? 0 : 1;
+}
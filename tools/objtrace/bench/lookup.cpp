@@ -0,0 +1,82 @@
+/****
+ * lookup.cpp
+ *
+ * Per-access cost of objTraceLoadInstr/objTraceStoreInstr against 10^3 ..
+ * 10^6 live objects: random accesses inside random objects (hits), the same
+ * object again and again (the common case), and addresses outside the heap
+ * (misses), and the same object again in objTraceAccessBatch calls of 16
+ * accesses. The runtime is compiled in so that the numbers are the lookup
+ * and the trace ring, not the PLT; the trace goes to /dev/null. Accesses
+ * come from 1024 distinct instructions and the objects from 256 sites.
+ * lookup-deps is the same with -DOBJTRACE_DEPS.
+ *
+ * usage: lookup [max objects] [accesses]
+ ****/
+#include "../objtraceruntime.cpp"
+#include <time.h>
+#include <stdlib.h>
+
+static double wallNs () {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main (int argc, char **argv) {
+  size_t maxObjs = argc > 1 ? strtoul(argv[1], 0, 0) : 1000000;
+  size_t accesses = argc > 2 ? strtoul(argv[2], 0, 0) : 2000000;
+  setenv("OBJTRACE_OUT", "/dev/null", 1);
+  objTraceInitialize();
+
+  std::vector<char*> objs;
+  std::vector<char*> addrs(accesses);
+  printf("%10s %12s %12s %12s %12s\n", "objects", "random ns", "same ns", "miss ns", "batch ns");
+
+  for (size_t n = 1000; n <= maxObjs; n *= 10) {
+    while (objs.size() < n)
+      objs.push_back((char*) objTraceMalloc(16 + rand() % 240, objs.size() % 256));
+
+    for (size_t i = 0; i < accesses; ++i)
+      addrs[i] = objs[rand() % n] + rand() % 16;
+
+    size_t hits = 0;
+    AllocTableElem elem;
+    for (size_t i = 0; i < accesses; ++i)
+      hits += findAlloc(addrs[i], elem);
+
+    double t0 = wallNs();
+    for (size_t i = 0; i < accesses; ++i)
+      objTraceLoadInstr(addrs[i], i & 1023);
+    double t1 = wallNs();
+
+    char *same = objs[n / 2];
+    double t2 = wallNs();
+    for (size_t i = 0; i < accesses; ++i)
+      objTraceStoreInstr(same + (i & 15), i & 1023);
+    double t3 = wallNs();
+
+    char stack[16];
+    double t4 = wallNs();
+    for (size_t i = 0; i < accesses; ++i)
+      objTraceLoadInstr(stack + (i & 15), i & 1023);
+    double t5 = wallNs();
+
+    ObjTraceAccess batch[16];
+    double t6 = wallNs();
+    for (size_t i = 0; i < accesses; i += 16) {
+      for (size_t j = 0; j < 16; ++j)
+        batch[j] = {reinterpret_cast<uint64_t>(same + j) | TRACE_STORE, (i + j) & 1023};
+      objTraceAccessBatch(batch, 16);
+    }
+    double t7 = wallNs();
+
+    printf("%10zu %12.1f %12.1f %12.1f %12.1f%s\n", n, (t1 - t0) / accesses,
+           (t3 - t2) / accesses, (t5 - t4) / accesses, (t7 - t6) / accesses,
+           hits != accesses ? "  (MISSED HEAP ACCESSES)" : "");
+  }
+
+  for (size_t i = 0; i < objs.size(); ++i)
+    objTraceFree(objs[i], 0);
+  objTraceFinalize();
+  return 0;
+}
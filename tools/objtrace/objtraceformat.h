@@ -0,0 +1,155 @@
+#ifndef LLVM_CORELAB_OBJTRACE_FORMAT_H
+#define LLVM_CORELAB_OBJTRACE_FORMAT_H
+
+#include <stdint.h>
+
+/****
+ * objtraceformat.h
+ *
+ * Files written by the ObjTrace runtime, shared with the analyzer. Every
+ * file starts with a TraceHeader; all fixed-size fields are native-endian.
+ ****/
+
+typedef uint16_t InstrID;
+typedef uint64_t FullID;
+
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize; // 0 if records are variable-length
+};
+
+/****
+ * Trace (prof.objtrace.bin, or $OBJTRACE_OUT): chunks of one thread's
+ * events, each a TraceChunk followed by size bytes. With rawSize == size
+ * they are the encoded events, otherwise the events deflated with zlib
+ * (runtime built with -DOBJTRACE_ZLIB). Every chunk can be decoded on its
+ * own, with a fresh TraceCodec.
+ *
+ * An event is a varint of zigzag(addr - previous addr) << 2 | kind, then
+ *   load, store  zigzag(instr - previous instr), zigzag(site - previous site)
+ *   alloc        varint size, zigzag(site - previous site), zigzag(time - previous time)
+ *   free         zigzag(site - previous site), zigzag(time - previous time)
+ * where site is the FullID of the allocation call and time is in
+ * CLOCK_MONOTONIC nanoseconds.
+ ****/
+#define TRACE_MAGIC "OBJTRACE"
+#define TRACE_VERSION 2
+
+// The kind is also kept in the top two bits of an address, so that
+// TRACE_STORE marks a store wherever an address is passed around.
+enum TraceEventKind { TraceLoad, TraceAlloc, TraceStore, TraceFree };
+#define TRACE_KIND_SHIFT 62
+#define TRACE_STORE ((uint64_t) TraceStore << TRACE_KIND_SHIFT)
+#define TRACE_ADDR_MASK ((1ull << TRACE_KIND_SHIFT) - 1)
+
+struct TraceChunk {
+  uint32_t tid;
+  uint32_t count;   // events
+  uint32_t size;    // bytes that follow
+  uint32_t rawSize; // bytes of the encoded events
+};
+
+struct TraceEvent {
+  uint32_t kind;      // TraceEventKind
+  uint64_t addr;
+  FullID instrFullId; // loads and stores
+  FullID allocFullId;
+  uint64_t size;      // allocs
+  uint64_t time;      // allocs and frees
+};
+
+#define TRACE_MAX_EVENT_BYTES 40
+
+struct TraceCodec {
+  uint64_t addr, instr, site, time;
+
+  TraceCodec () : addr(0), instr(0), site(0), time(0) {}
+
+  static uint8_t *putVarint (uint8_t *p, uint64_t v) {
+    for (; v >= 0x80; v >>= 7)
+      *p++ = (uint8_t) (v | 0x80);
+    *p++ = (uint8_t) v;
+    return p;
+  }
+
+  static bool getVarint (const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+      uint8_t b = *p++;
+      v |= (uint64_t) (b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  static uint64_t zigzag (uint64_t next, uint64_t prev) {
+    int64_t d = (int64_t) (next - prev);
+    return ((uint64_t) d << 1) ^ (uint64_t) (d >> 63);
+  }
+
+  static uint64_t unzigzag (uint64_t z, uint64_t prev) {
+    return prev + ((z >> 1) ^ (0 - (z & 1)));
+  }
+
+  // Appends e, at most TRACE_MAX_EVENT_BYTES.
+  uint8_t *encode (uint8_t *p, const TraceEvent &e) {
+    p = putVarint(p, zigzag(e.addr, addr) << 2 | e.kind);
+    addr = e.addr;
+    if (e.kind == TraceLoad || e.kind == TraceStore) {
+      p = putVarint(p, zigzag(e.instrFullId, instr));
+      instr = e.instrFullId;
+    } else if (e.kind == TraceAlloc) {
+      p = putVarint(p, e.size);
+    }
+    p = putVarint(p, zigzag(e.allocFullId, site));
+    site = e.allocFullId;
+    if (e.kind == TraceAlloc || e.kind == TraceFree) {
+      p = putVarint(p, zigzag(e.time, time));
+      time = e.time;
+    }
+    return p;
+  }
+
+  bool decode (const uint8_t *&p, const uint8_t *end, TraceEvent &e) {
+    uint64_t v;
+    if (!getVarint(p, end, v))
+      return false;
+    e.kind = v & 3;
+    e.addr = addr = unzigzag(v >> 2, addr);
+    e.instrFullId = e.size = e.time = 0;
+    if (e.kind == TraceLoad || e.kind == TraceStore) {
+      if (!getVarint(p, end, v))
+        return false;
+      e.instrFullId = instr = unzigzag(v, instr);
+    } else if (e.kind == TraceAlloc && !getVarint(p, end, e.size)) {
+      return false;
+    }
+    if (!getVarint(p, end, v))
+      return false;
+    e.allocFullId = site = unzigzag(v, site);
+    if (e.kind == TraceAlloc || e.kind == TraceFree) {
+      if (!getVarint(p, end, v))
+        return false;
+      e.time = time = unzigzag(v, time);
+    }
+    return true;
+  }
+};
+
+/****
+ * Dependence profile (runtime built with -DOBJTRACE_DEPS; prof.objtrace.deps,
+ * or $OBJTRACE_OUT): DepEntries sorted by instruction and allocation site.
+ ****/
+#define DEPS_MAGIC "OBJDEPS"
+#define DEPS_VERSION 1
+
+struct DepEntry {
+  FullID instrFullId;
+  FullID allocFullId;
+  uint64_t loads;
+  uint64_t stores;
+};
+
+#endif
@@ -1,8 +1,28 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include <assert.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <malloc.h>
+#ifdef OBJTRACE_ZLIB
+#include <zlib.h>
+#endif
+#include <new>
 
 #include "objtraceruntime.h"
+#include "../objarena/objarena.h"
+
+// Programs rewritten by opt -objarena link libobjarena as well; others do
+// not need it.
+#pragma weak objArenaMalloc
+#pragma weak objArenaCalloc
+#pragma weak objArenaRealloc
+#pragma weak objArenaFree
 
 /****
  * objtraceruntime.cpp
@@ -10,7 +30,11 @@
  * objTrace[Malloc,Calloc,Realloc,Free] functions deal with "AllocTable" which
  * maintains the information where was allocated, how big and who allocated.
  * objTrace[Load,Store]Instr functions check whether given "addr" indicates
- * heap space or not.
+ * heap space or not, and if so append a record to the thread's TraceRing,
+ * which a flusher thread streams to the trace file, or with -DOBJTRACE_DEPS
+ * count the access in the thread's DepTable, with -DOBJTRACE_CACHESIM run it
+ * through the thread's CacheSim, or with -DOBJTRACE_REUSE sample its reuse
+ * distance in the thread's ReuseSampler.
  *
  * Written by Bongjun.
  ****/
@@ -18,104 +42,1134 @@
 typedef uint16_t InstrID;
 typedef uint64_t FullID;
 
+enum TraceState { TraceIdle, TraceRunning, TraceStopped };
+static std::atomic<int> State(TraceIdle);
+static pthread_once_t StartOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ThreadKey;
+static std::atomic<uint32_t> NextTid(0);
+#ifdef OBJTRACE_TRACE
+static pthread_t Flusher;
+static int traceFd = -1;
+#endif
+
+// Sampling gate state of the thread; only code built with
+// -objtrace-sample-period touches it.
+extern "C" {
+__thread uint64_t objTraceSampleCount = 0;
+}
+
+#ifdef OBJTRACE_TRACE
+// Encodes (and with -DOBJTRACE_ZLIB deflates) count records of a ring and
+// writes them as one chunk.
+static void writeChunk (uint32_t tid, const TraceRecord *records, uint64_t count) {
+  static uint8_t *encoded = NULL;
+  if (!encoded)
+    encoded = static_cast<uint8_t*>(malloc(OBJTRACE_RING_RECORDS * TRACE_MAX_EVENT_BYTES));
+
+  TraceCodec codec;
+  uint8_t *end = encoded;
+  for (uint64_t i = 0; i < count; ++i) {
+    const TraceRecord &r = records[i];
+    TraceEvent e;
+    e.kind = r.addr >> TRACE_KIND_SHIFT;
+    e.addr = r.addr & TRACE_ADDR_MASK;
+    e.instrFullId = e.kind == TraceAlloc ? 0 : r.value;
+    e.size = e.kind == TraceAlloc ? r.value : 0;
+    e.allocFullId = r.allocFullId;
+    e.time = r.time;
+    end = codec.encode(end, e);
+  }
+
+  TraceChunk chunk = {tid, (uint32_t) count, (uint32_t) (end - encoded), (uint32_t) (end - encoded)};
+  const uint8_t *payload = encoded;
+#ifdef OBJTRACE_ZLIB
+  static uint8_t *deflated = NULL;
+  static uLongf deflatedSize = 0;
+  if (!deflated) {
+    deflatedSize = compressBound(OBJTRACE_RING_RECORDS * TRACE_MAX_EVENT_BYTES);
+    deflated = static_cast<uint8_t*>(malloc(deflatedSize));
+  }
+  uLongf size = deflatedSize;
+  if (compress2(deflated, &size, encoded, chunk.rawSize, Z_BEST_SPEED) == Z_OK &&
+      size < chunk.rawSize) {
+    chunk.size = size;
+    payload = deflated;
+  }
+#endif
+
+  struct iovec iov[2] = {
+    {&chunk, sizeof(chunk)},
+    {const_cast<uint8_t*>(payload), chunk.size}};
+  if (traceFd >= 0 && writev(traceFd, iov, 2) < 0)
+    perror("objtrace: writev");
+}
+
+// Writes every ring's pending records; returns how many there were.
+static size_t drainRings () {
+  size_t total = 0;
+  for (TraceRing *r = TraceRings.load(std::memory_order_acquire); r; r = r->next) {
+    uint64_t head = r->head.load(std::memory_order_acquire);
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+
+    // one chunk per contiguous run of the ring
+    while (tail != head) {
+      uint64_t first = tail % OBJTRACE_RING_RECORDS;
+      uint64_t count = std::min<uint64_t>(head - tail, OBJTRACE_RING_RECORDS - first);
+      writeChunk(r->tid, &r->records[first], count);
+      tail += count;
+      total += count;
+      r->tail.store(tail, std::memory_order_release);
+    }
+  }
+  return total;
+}
+
+static void *flushLoop (void *) {
+  struct timespec idle = {0, 1000000};
+  while (State.load(std::memory_order_acquire) == TraceRunning)
+    if (!drainRings())
+      nanosleep(&idle, NULL);
+  while (drainRings())
+    ;
+  return NULL;
+}
+#endif
+
+static void returnRecords (unsigned count);
+#ifdef OBJTRACE_CACHESIM
+static void configureCaches ();
+#endif
+#ifdef OBJTRACE_REUSE
+static void configureReuse ();
+#endif
+
+// Thread exit: the ring (or dependence table, cache model or reuse sampler)
+// goes to the next new thread once drained, and the cached allocation
+// records back to the pool. An event later in the thread's teardown (another
+// key's destructor) acquires a ring again, which re-arms the key.
+static void threadExit (void *) {
+  if (MyRing)
+    MyRing->owned.store(false, std::memory_order_release);
+  if (MyDeps)
+    MyDeps->owned.store(false, std::memory_order_release);
+  if (MySim)
+    MySim->owned.store(false, std::memory_order_release);
+  if (MyReuse)
+    MyReuse->owned.store(false, std::memory_order_release);
+  MyRing = NULL;
+  MyDeps = NULL;
+  MySim = NULL;
+  MyReuse = NULL;
+  returnRecords(~0u);
+}
+
+#if defined(OBJTRACE_TRACE) || defined(OBJTRACE_DEPS)
+static int openOutput (const char *defaultPath, const char *magic, uint32_t version, uint32_t recordSize) {
+  const char *path = getenv("OBJTRACE_OUT");
+  int fd = open(path ? path : defaultPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("objtrace: cannot open the output file");
+    return fd;
+  }
+  TraceHeader header;
+  memcpy(header.magic, magic, sizeof(header.magic));
+  header.version = version;
+  header.recordSize = recordSize;
+  if (write(fd, &header, sizeof(header)) != sizeof(header))
+    perror("objtrace: write");
+  return fd;
+}
+#endif
+
+static void startTrace () {
+  pthread_key_create(&ThreadKey, threadExit);
+#if defined(OBJTRACE_CACHESIM)
+  configureCaches();
+#elif defined(OBJTRACE_REUSE)
+  configureReuse();
+#endif
+#ifdef OBJTRACE_TRACE
+  traceFd = openOutput("prof.objtrace.bin", TRACE_MAGIC, TRACE_VERSION, 0);
+  State.store(TraceRunning, std::memory_order_release);
+  pthread_create(&Flusher, NULL, flushLoop, NULL);
+#else
+  State.store(TraceRunning, std::memory_order_release);
+#endif
+}
+
+// A drained ring of an exited thread, or a new one.
+static TraceRing *acquireRing () {
+  pthread_once(&StartOnce, startTrace);
+
+  TraceRing *ring = NULL;
+  for (TraceRing *r = TraceRings.load(std::memory_order_acquire); r && !ring; r = r->next) {
+    bool owned = false;
+    if (r->owned.load(std::memory_order_relaxed) ||
+        !r->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+      continue;
+    if (r->head.load(std::memory_order_relaxed) == r->tail.load(std::memory_order_acquire))
+      ring = r;
+    else
+      r->owned.store(false, std::memory_order_release);
+  }
+
+  if (!ring) {
+    void *p = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(p != MAP_FAILED && "Cannot map a trace ring.");
+    ring = new (p) TraceRing();
+    ring->owned.store(true, std::memory_order_relaxed);
+    ring->next = TraceRings.load(std::memory_order_relaxed);
+    while (!TraceRings.compare_exchange_weak(ring->next, ring, std::memory_order_release))
+      ;
+  }
+
+  ring->tid = NextTid.fetch_add(1, std::memory_order_relaxed);
+  pthread_setspecific(ThreadKey, ring);
+  return ring;
+}
+
+// addr carries the kind of the event, see TraceRecord.
+static inline void traceEvent (uint64_t addr, uint64_t value, FullID allocFullId, uint64_t time) {
+  if (State.load(std::memory_order_relaxed) == TraceStopped)
+    return;
+  TraceRing *ring = MyRing;
+  if (!ring)
+    ring = MyRing = acquireRing();
+
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  while (head - ring->tail.load(std::memory_order_acquire) == OBJTRACE_RING_RECORDS)
+    sched_yield();
+  ring->records[head % OBJTRACE_RING_RECORDS] = {addr, value, allocFullId, time};
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+static inline uint64_t nowNs () {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Allocations and frees, for lifetimes; only the trace has a use for them.
+static inline void traceAllocEvent (uint64_t kind, void *addr, uint64_t size, FullID allocFullId) {
+#ifdef OBJTRACE_TRACE
+  traceEvent(reinterpret_cast<uint64_t>(addr) | kind << TRACE_KIND_SHIFT, size, allocFullId, nowNs());
+#else
+  (void) kind, (void) addr, (void) size, (void) allocFullId;
+#endif
+}
+
+static DepEntry *newDepEntries (uint64_t n) {
+  DepEntry *entries = static_cast<DepEntry*>(calloc(n, sizeof(DepEntry)));
+  assert(entries && "Cannot allocate a dependence table.");
+  return entries;
+}
+
+static DepEntry *findDep (DepTable *t, FullID instrFullId, FullID allocFullId) {
+  // ids are dense, so mix them well (murmur3's finalizer)
+  uint64_t h = instrFullId * 0x9e3779b97f4a7c15ull + allocFullId;
+  h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdull;
+  h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  for (uint64_t i = h & t->mask;; i = (i + 1) & t->mask) {
+    DepEntry *e = &t->entries[i];
+    if ((e->instrFullId == instrFullId && e->allocFullId == allocFullId) ||
+        !(e->loads | e->stores))
+      return e;
+  }
+}
+
+// Doubles t once it is three quarters full.
+static void growDeps (DepTable *t) {
+  DepTable bigger;
+  bigger.mask = 2 * t->mask + 1;
+  bigger.entries = newDepEntries(bigger.mask + 1);
+  for (uint64_t i = 0; i <= t->mask; ++i) {
+    DepEntry &e = t->entries[i];
+    if (e.loads | e.stores)
+      *findDep(&bigger, e.instrFullId, e.allocFullId) = e;
+  }
+  free(t->entries);
+  t->entries = bigger.entries;
+  t->mask = bigger.mask;
+}
+
+// The per-thread state of an exited thread, claimed for this one, or NULL.
+template <typename T>
+static T *claimUnowned (std::atomic<T*> &list) {
+  for (T *t = list.load(std::memory_order_acquire); t; t = t->next) {
+    bool owned = false;
+    if (!t->owned.load(std::memory_order_relaxed) &&
+        t->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+      return t;
+  }
+  return NULL;
+}
+
+// Adds new per-thread state, owned by this thread, to list.
+template <typename T>
+static void publish (std::atomic<T*> &list, T *t) {
+  t->owned.store(true, std::memory_order_relaxed);
+  t->next = list.load(std::memory_order_relaxed);
+  while (!list.compare_exchange_weak(t->next, t, std::memory_order_release))
+    ;
+}
+
+// The table of an exited thread, or a new one.
+static DepTable *acquireDeps () {
+  pthread_once(&StartOnce, startTrace);
+
+  DepTable *table = claimUnowned(DepTables);
+  if (!table) {
+    table = new DepTable();
+    table->mask = OBJTRACE_DEPS_ENTRIES - 1;
+    table->entries = newDepEntries(OBJTRACE_DEPS_ENTRIES);
+    publish(DepTables, table);
+  }
+
+  pthread_setspecific(ThreadKey, table);
+  return table;
+}
+
+static inline void countAccess (uint64_t kind, FullID instrFullId, FullID allocFullId) {
+  if (State.load(std::memory_order_relaxed) == TraceStopped)
+    return;
+  DepTable *t = MyDeps;
+  if (!t)
+    t = MyDeps = acquireDeps();
+
+  DepEntry *e = findDep(t, instrFullId, allocFullId);
+  bool fresh = !(e->loads | e->stores);
+  e->instrFullId = instrFullId;
+  e->allocFullId = allocFullId;
+  ++(kind ? e->stores : e->loads);
+  if (fresh && 4 * ++t->used > 3 * (t->mask + 1))
+    growDeps(t);
+}
+
+#ifdef OBJTRACE_DEPS
+static bool depLess (const DepEntry &a, const DepEntry &b) {
+  return a.instrFullId != b.instrFullId ? a.instrFullId < b.instrFullId
+                                        : a.allocFullId < b.allocFullId;
+}
+
+// Sums the tables of all threads and writes the profile.
+static void writeDeps () {
+  std::vector<DepEntry> all;
+  for (DepTable *t = DepTables.load(std::memory_order_acquire); t; t = t->next)
+    for (uint64_t i = 0; i <= t->mask; ++i)
+      if (t->entries[i].loads | t->entries[i].stores)
+        all.push_back(t->entries[i]);
+  std::sort(all.begin(), all.end(), depLess);
+
+  size_t n = 0;
+  for (size_t i = 0; i < all.size(); ++i) {
+    if (n && !depLess(all[n - 1], all[i])) {
+      all[n - 1].loads += all[i].loads;
+      all[n - 1].stores += all[i].stores;
+    } else {
+      all[n++] = all[i];
+    }
+  }
+
+  int fd = openOutput("prof.objtrace.deps", DEPS_MAGIC, DEPS_VERSION, sizeof(DepEntry));
+  if (fd < 0)
+    return;
+  const char *p = reinterpret_cast<const char*>(all.data());
+  for (size_t left = n * sizeof(DepEntry); left;) {
+    ssize_t w = write(fd, p, left);
+    if (w < 0) {
+      perror("objtrace: write");
+      break;
+    }
+    p += w;
+    left -= w;
+  }
+  close(fd);
+}
+#endif
+
+/****
+ * Cache simulation (build with -DOBJTRACE_CACHESIM): every thread runs the
+ * heap accesses it traces through its own model of a cache hierarchy, as if
+ * it had a core to itself, and counts the misses of each level per
+ * allocation site. $OBJTRACE_CACHE gives the levels, from L1 outwards, as
+ * size:ways[,size:ways...] (default 32768:8,262144:8,8388608:16), and
+ * $OBJTRACE_CACHE_LINE the line size (64). Stack and global accesses are
+ * not traced, so they do not evict anything in the model.
+ ****/
+static unsigned NumCacheLevels = 0;
+static unsigned LineShift = 6;
+static uint64_t CacheSizes[OBJTRACE_CACHE_LEVELS];
+static unsigned CacheWays[OBJTRACE_CACHE_LEVELS];
+
+#if defined(OBJTRACE_CACHESIM) || defined(OBJTRACE_REUSE)
+static void configureLine () {
+  const char *line = getenv("OBJTRACE_CACHE_LINE");
+  uint64_t lineSize = line ? strtoull(line, NULL, 0) : 64;
+  for (LineShift = 0; (2ull << LineShift) <= lineSize; ++LineShift)
+    ;
+}
+#endif
+
+#ifdef OBJTRACE_CACHESIM
+static void configureCaches () {
+  const char *config = getenv("OBJTRACE_CACHE");
+  if (!config)
+    config = "32768:8,262144:8,8388608:16";
+  configureLine();
+
+  for (const char *p = config; *p && NumCacheLevels < OBJTRACE_CACHE_LEVELS; ) {
+    char *end;
+    uint64_t size = strtoull(p, &end, 0);
+    unsigned ways = *end == ':' ? strtoul(end + 1, &end, 0) : 1;
+    if (!size || !ways || size < (ways << LineShift)) {
+      fprintf(stderr, "objtrace: bad cache level in OBJTRACE_CACHE: %s\n", p);
+      break;
+    }
+    CacheSizes[NumCacheLevels] = size;
+    CacheWays[NumCacheLevels++] = ways;
+    p = *end == ',' ? end + 1 : end;
+    if (*end && *end != ',')
+      break;
+  }
+}
+#endif
+
+static CacheSim *acquireSim () {
+  pthread_once(&StartOnce, startTrace);
+
+  CacheSim *sim = claimUnowned(CacheSims);
+  if (!sim) {
+    sim = new CacheSim();
+    for (unsigned l = 0; l < NumCacheLevels; ++l) {
+      CacheLevel &c = sim->levels[l];
+      c.ways = CacheWays[l];
+      c.sets = std::max<uint64_t>(CacheSizes[l] >> LineShift, c.ways) / c.ways;
+      c.tags = new uint64_t[c.sets * c.ways];
+      std::fill(c.tags, c.tags + c.sets * c.ways, ~0ull);
+    }
+    publish(CacheSims, sim);
+  }
+
+  pthread_setspecific(ThreadKey, sim);
+  return sim;
+}
+
+// LRU within the set: tags are kept most recently used first.
+static inline bool accessLevel (CacheLevel &c, uint64_t line) {
+  uint64_t *set = &c.tags[(line % c.sets) * c.ways];
+  unsigned i = 0;
+  while (i < c.ways - 1 && set[i] != line)
+    ++i;
+  bool hit = set[i] == line;
+  memmove(set + 1, set, i * sizeof(uint64_t));
+  set[0] = line;
+  return hit;
+}
+
+static inline void simulateAccess (void *addr, FullID allocFullId) {
+  if (State.load(std::memory_order_relaxed) == TraceStopped)
+    return;
+  CacheSim *sim = MySim;
+  if (!sim)
+    sim = MySim = acquireSim();
+
+  if (!sim->lastSite || sim->lastSiteId != allocFullId) {
+    sim->lastSite = &sim->sites[allocFullId];
+    sim->lastSiteId = allocFullId;
+  }
+  SiteMisses &site = *sim->lastSite;
+  ++site.accesses;
+  uint64_t line = reinterpret_cast<uint64_t>(addr) >> LineShift;
+  for (unsigned l = 0; l < NumCacheLevels && !accessLevel(sim->levels[l], line); ++l)
+    ++site.misses[l];
+}
+
+#ifdef OBJTRACE_CACHESIM
+// Sums the sites of all threads and writes the miss rates, the sites that
+// miss most in the last level first.
+static void writeCacheReport () {
+  std::map<FullID, SiteMisses> sites;
+  for (CacheSim *sim = CacheSims.load(std::memory_order_acquire); sim; sim = sim->next)
+    for (auto &site : sim->sites) {
+      SiteMisses &sum = sites[site.first];
+      sum.accesses += site.second.accesses;
+      for (unsigned l = 0; l < NumCacheLevels; ++l)
+        sum.misses[l] += site.second.misses[l];
+    }
+
+  std::vector<std::pair<FullID, SiteMisses> > sorted(sites.begin(), sites.end());
+  unsigned last = NumCacheLevels ? NumCacheLevels - 1 : 0;
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [last](const std::pair<FullID, SiteMisses> &a, const std::pair<FullID, SiteMisses> &b) {
+                     return a.second.misses[last] > b.second.misses[last];
+                   });
+
+  const char *path = getenv("OBJTRACE_OUT");
+  FILE *out = fopen(path ? path : "prof.objtrace.cache", "w");
+  if (!out) {
+    perror("objtrace: cannot open the output file");
+    return;
+  }
+  fprintf(out, "# line %u", 1u << LineShift);
+  for (unsigned l = 0; l < NumCacheLevels; ++l)
+    fprintf(out, ", L%u %lu:%u", l + 1, CacheSizes[l], CacheWays[l]);
+  fprintf(out, "\n%20s %14s", "site", "accesses");
+  for (unsigned l = 0; l < NumCacheLevels; ++l)
+    fprintf(out, "    L%u misses   rate", l + 1);
+  fprintf(out, "\n");
+  for (auto &site : sorted) {
+    fprintf(out, "%20lu %14lu", site.first, site.second.accesses);
+    for (unsigned l = 0; l < NumCacheLevels; ++l)
+      fprintf(out, " %12lu %6.2f%%", site.second.misses[l],
+              100.0 * site.second.misses[l] / site.second.accesses);
+    fprintf(out, "\n");
+  }
+  fclose(out);
+}
+#endif
+
+/****
+ * Locality profile (build with -DOBJTRACE_REUSE): per allocation site,
+ * histograms of the reuse distance of its accesses (distinct cache lines,
+ * of $OBJTRACE_CACHE_LINE bytes, touched by the thread since the line was
+ * last touched), of its objects' sizes and of their lifetimes.
+ *
+ * Reuse distances are computed on a spatially hashed sample of the lines
+ * (SHARDS): a line is followed iff its hash is below the threshold, a
+ * Fenwick tree over the times of the last accesses of the followed lines
+ * counts the distinct ones since any time, and a distance is scaled up by
+ * the sampling rate. At most $OBJTRACE_REUSE_LINES (16384) lines are followed
+ * per thread; past that the threshold drops to the hash of the line it
+ * evicts, so memory stays bounded however long the run.
+ ****/
+#define REUSE_HASH_BITS 24
+
+#ifdef OBJTRACE_REUSE
+static size_t MaxReuseLines = 1 << 14;
+
+static void configureReuse () {
+  configureLine();
+  const char *lines = getenv("OBJTRACE_REUSE_LINES");
+  if (lines && strtoull(lines, NULL, 0))
+    MaxReuseLines = strtoull(lines, NULL, 0);
+}
+
+static inline unsigned histBucket (uint64_t v) {
+  return std::min<unsigned>(v ? 64 - __builtin_clzll(v) : 0, HIST_BUCKETS - 1);
+}
+
+static inline void histAdd (Histogram &h, uint64_t v) {
+  ++h.count;
+  ++h.buckets[histBucket(v)];
+}
+
+static inline uint32_t lineHash (uint64_t line) {
+  return (line * 0x9e3779b97f4a7c15ull) >> (64 - REUSE_HASH_BITS);
+}
+
+static void markTime (ReuseSampler *r, uint64_t t, int delta) {
+  for (++t; t <= r->marks.size(); t += t & -t)
+    r->marks[t - 1] += delta;
+}
+
+// Marks at times up to and including t.
+static uint64_t marksUpTo (ReuseSampler *r, uint64_t t) {
+  uint64_t sum = 0;
+  for (++t; t; t -= t & -t)
+    sum += r->marks[t - 1];
+  return sum;
+}
+
+// Renumbers the last accesses 0..n-1 once the tree is full.
+static void compactTimes (ReuseSampler *r) {
+  std::vector<std::pair<uint64_t, uint64_t> > byTime;
+  for (auto &l : r->last)
+    byTime.push_back(std::make_pair(l.second, l.first));
+  std::sort(byTime.begin(), byTime.end());
+  std::fill(r->marks.begin(), r->marks.end(), 0);
+  for (uint64_t t = 0; t < byTime.size(); ++t) {
+    r->last[byTime[t].second] = t;
+    markTime(r, t, 1);
+  }
+  r->now = byTime.size();
+}
+
+static ReuseSampler *acquireReuse () {
+  pthread_once(&StartOnce, startTrace);
+
+  ReuseSampler *r = claimUnowned(ReuseSamplers);
+  if (!r) {
+    r = new ReuseSampler();
+    r->threshold = 1u << REUSE_HASH_BITS;
+    r->marks.resize(4 * MaxReuseLines);
+    publish(ReuseSamplers, r);
+  }
+
+  pthread_setspecific(ThreadKey, r);
+  return r;
+}
+
+static inline SiteLocality &localityOf (ReuseSampler *r, FullID allocFullId) {
+  if (!r->lastSite || r->lastSiteId != allocFullId) {
+    r->lastSite = &r->sites[allocFullId];
+    r->lastSiteId = allocFullId;
+  }
+  return *r->lastSite;
+}
+
+static inline ReuseSampler *myReuse () {
+  ReuseSampler *r = MyReuse;
+  return r ? r : MyReuse = acquireReuse();
+}
+
+static void sampleReuse (void *addr, FullID allocFullId) {
+  if (State.load(std::memory_order_relaxed) == TraceStopped)
+    return;
+  ReuseSampler *r = myReuse();
+  uint64_t line = reinterpret_cast<uint64_t>(addr) >> LineShift;
+  uint32_t hash = lineHash(line);
+  if (hash >= r->threshold)
+    return;
+
+  Histogram &reuse = localityOf(r, allocFullId).reuse;
+  auto it = r->last.find(line);
+  if (it != r->last.end()) {
+    uint64_t distinct = marksUpTo(r, r->now - 1) - marksUpTo(r, it->second);
+    histAdd(reuse, (distinct << REUSE_HASH_BITS) / r->threshold);
+    markTime(r, it->second, -1);
+    it->second = r->now;
+  } else {
+    ++reuse.count;
+    ++reuse.never;
+    r->last[line] = r->now;
+    r->byHash.insert(std::make_pair(hash, line));
+  }
+  markTime(r, r->now++, 1);
+
+  while (r->last.size() > MaxReuseLines) {
+    auto evict = --r->byHash.end();
+    r->threshold = evict->first;
+    auto victim = r->last.find(evict->second);
+    markTime(r, victim->second, -1);
+    r->last.erase(victim);
+    r->byHash.erase(evict);
+  }
+  if (r->now == r->marks.size())
+    compactTimes(r);
+}
+
+static void countAlloc (const AllocTableElem &elem) {
+  if (State.load(std::memory_order_relaxed) != TraceStopped)
+    histAdd(localityOf(myReuse(), elem.fullId).size, elem.size);
+}
+
+static void countFree (const AllocTableElem &elem) {
+  if (State.load(std::memory_order_relaxed) != TraceStopped)
+    histAdd(localityOf(myReuse(), elem.fullId).life, nowNs() - elem.time);
+}
+
+static void printHistogram (FILE *out, const char *name, const Histogram &h, const char *unit) {
+  if (!h.count)
+    return;
+  fprintf(out, "  %-6s n=%lu", name, h.count);
+  if (h.never)
+    fprintf(out, " new=%lu", h.never);
+  for (unsigned i = 0; i < HIST_BUCKETS; ++i)
+    if (h.buckets[i])
+      fprintf(out, " <%llu%s:%lu", 1ull << i, unit, h.buckets[i]);
+  fprintf(out, "\n");
+}
+
+static void addHistogram (Histogram &sum, const Histogram &h) {
+  sum.count += h.count;
+  sum.never += h.never;
+  for (unsigned i = 0; i < HIST_BUCKETS; ++i)
+    sum.buckets[i] += h.buckets[i];
+}
+
+// Sums the sites of all threads and writes their histograms, the sites with
+// the most sampled accesses first.
+static void writeLocality () {
+  std::map<FullID, SiteLocality> sites;
+  for (ReuseSampler *r = ReuseSamplers.load(std::memory_order_acquire); r; r = r->next)
+    for (auto &site : r->sites) {
+      SiteLocality &sum = sites[site.first];
+      addHistogram(sum.reuse, site.second.reuse);
+      addHistogram(sum.size, site.second.size);
+      addHistogram(sum.life, site.second.life);
+    }
+
+  std::vector<std::pair<FullID, SiteLocality> > sorted(sites.begin(), sites.end());
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const std::pair<FullID, SiteLocality> &a, const std::pair<FullID, SiteLocality> &b) {
+                     return a.second.reuse.count > b.second.reuse.count;
+                   });
+
+  const char *path = getenv("OBJTRACE_OUT");
+  FILE *out = fopen(path ? path : "prof.objtrace.reuse", "w");
+  if (!out) {
+    perror("objtrace: cannot open the output file");
+    return;
+  }
+  fprintf(out, "# reuse: sampled accesses by distance in %u-byte lines (new: first touch); "
+          "size: objects by bytes; life: freed objects by ns\n", 1u << LineShift);
+  for (auto &site : sorted) {
+    fprintf(out, "site %lu\n", site.first);
+    printHistogram(out, "reuse", site.second.reuse, "");
+    printHistogram(out, "size", site.second.size, "B");
+    printHistogram(out, "life", site.second.life, "ns");
+  }
+  fclose(out);
+}
+#endif
+
 extern "C"
 void objTraceInitialize () {
   DEBUG("@@@ OBJTRACE RUNTIME PROFILER INITIALIZE @@@\n");
-  profOut = fopen("prof.objtrace.log", "w");
-  fprintf(profOut, "##### OBJTRACE RUNTIME PROFILER INITIALIZE #####\n");
+  pthread_once(&StartOnce, startTrace);
 }
 
 extern "C"
 void objTraceFinalize () {
   DEBUG("\n@@@ OBJTRACE RUNTIME PROFILER FINALIZE @@@\n");
-  for (auto i : MemoryAccessHistoryTable) {
-    DEBUG("ld: %lu, st: %lu, alloc: %lu, addr: %p\n", i.loadFullId,
-        i.storeFullId,
-        i.allocFullId,
-        i.addr);
-    fprintf(profOut, "%lu:%lu:%lu:%p\n", i.loadFullId,
-        i.storeFullId,
-        i.allocFullId,
-        i.addr);
+  int running = TraceRunning;
+  if (!State.compare_exchange_strong(running, TraceStopped))
+    return;
+#if defined(OBJTRACE_DEPS)
+  writeDeps();
+#elif defined(OBJTRACE_CACHESIM)
+  writeCacheReport();
+#elif defined(OBJTRACE_REUSE)
+  writeLocality();
+#else
+  pthread_join(Flusher, NULL);
+  if (traceFd >= 0)
+    close(traceFd);
+  traceFd = -1;
+#endif
+}
+
+/****
+ * Allocation index. Maps an address to the record of the live object that
+ * contains it in O(1) and without locks, through two shadow tables: one slot
+ * per 16-byte granule (malloc's alignment) of every small object and of the
+ * first and last partial pages of a large one, and one slot per page wholly
+ * inside a large object. Objects that start 16-byte aligned never share a
+ * granule. A granule that also holds the start of a misaligned object
+ * (allocators with finer alignment) keeps the object covering its first byte
+ * and gets MisalignedBit; the misaligned objects are found in
+ * MisalignedTable, under MisalignedLock. The tables are two-level and their
+ * leaves are mapped on first use, so untouched address space costs nothing.
+ *
+ * Records are recycled, never freed, so a reader can always look at the one
+ * a slot points to; AllocRecord::seq tells it whether what it read is
+ * consistent and still the same object.
+ ****/
+#define GRANULE_SHIFT 4
+#define PAGE_SHIFT 12
+#define LARGE_OBJECT (1 << 13)
+#define ADDR_BITS 48
+#define RECORD_BATCH 64
+
+static const uintptr_t MisalignedBit = 1;
+
+template <unsigned Shift, unsigned LeafBits>
+struct ShadowTable {
+  typedef std::atomic<uintptr_t> Slot;
+  static const unsigned DirBits = ADDR_BITS - Shift - LeafBits;
+  std::atomic<Slot*> dir[1ul << DirBits];
+
+  Slot *slot (uintptr_t addr, bool create) {
+    uintptr_t idx = (addr >> Shift) & ((1ul << (ADDR_BITS - Shift)) - 1);
+    std::atomic<Slot*> &d = dir[idx >> LeafBits];
+    Slot *leaf = d.load(std::memory_order_acquire);
+    if (!leaf) {
+      if (!create)
+        return NULL;
+      size_t size = sizeof(Slot) << LeafBits;
+      void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      assert(p != MAP_FAILED && "Cannot map the allocation index.");
+      if (d.compare_exchange_strong(leaf, static_cast<Slot*>(p)))
+        leaf = static_cast<Slot*>(p);
+      else
+        munmap(p, size);
+    }
+    return &leaf[idx & ((1ul << LeafBits) - 1)];
+  }
+
+  uintptr_t load (uintptr_t addr) {
+    Slot *e = slot(addr, false);
+    return e ? e->load(std::memory_order_acquire) : 0;
+  }
+};
+
+static ShadowTable<GRANULE_SHIFT, 24> GranuleShadow;
+static ShadowTable<PAGE_SHIFT, 20> PageShadow;
+static __thread AllocRecord *LastAlloc = NULL; // last allocation found by findAlloc
+
+// Record pool: a per-thread cache in front of a global free list, so the
+// lock is taken once per RECORD_BATCH allocations or frees.
+static AllocRecord *GlobalFree = NULL;
+static pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread AllocRecord *LocalFree = NULL;
+static __thread unsigned LocalFreeCount = 0;
+
+static AllocRecord *newRecord () {
+  if (!LocalFree) {
+    pthread_once(&StartOnce, startTrace);
+    pthread_setspecific(ThreadKey, &LocalFree);
+    pthread_mutex_lock(&PoolLock);
+    for (; GlobalFree && LocalFreeCount < RECORD_BATCH; ++LocalFreeCount) {
+      AllocRecord *r = GlobalFree;
+      GlobalFree = r->nextFree;
+      r->nextFree = LocalFree;
+      LocalFree = r;
+    }
+    pthread_mutex_unlock(&PoolLock);
+  }
+  if (!LocalFree) {
+    AllocRecord *chunk = new AllocRecord[RECORD_BATCH]();
+    for (unsigned i = 0; i < RECORD_BATCH; ++i) {
+      chunk[i].nextFree = LocalFree;
+      LocalFree = &chunk[i];
+    }
+    LocalFreeCount = RECORD_BATCH;
+  }
+  AllocRecord *r = LocalFree;
+  LocalFree = r->nextFree;
+  --LocalFreeCount;
+  return r;
+}
+
+static void returnRecords (unsigned count) {
+  pthread_mutex_lock(&PoolLock);
+  for (; LocalFree && count; --count, --LocalFreeCount) {
+    AllocRecord *r = LocalFree;
+    LocalFree = r->nextFree;
+    r->nextFree = GlobalFree;
+    GlobalFree = r;
+  }
+  pthread_mutex_unlock(&PoolLock);
+}
+
+static void freeRecord (AllocRecord *r) {
+  r->nextFree = LocalFree;
+  LocalFree = r;
+  if (++LocalFreeCount > 2 * RECORD_BATCH)
+    returnRecords(RECORD_BATCH);
+}
+
+// Seqlock on a record: writers make seq odd while they change it.
+static void writeRecord (AllocRecord *rec, void *addr, AllocTableElem elem) {
+  uint64_t seq = rec->seq.load(std::memory_order_relaxed);
+  rec->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  rec->addr = addr;
+  rec->elem = elem;
+  rec->seq.store(seq + 2, std::memory_order_release);
+}
+
+static bool readRecord (AllocRecord *rec, void *&addr, AllocTableElem &elem) {
+  uint64_t seq = rec->seq.load(std::memory_order_acquire);
+  if (seq & 1)
+    return false;
+  addr = rec->addr;
+  elem = rec->elem;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return rec->seq.load(std::memory_order_relaxed) == seq;
+}
+
+// Whether rec is a live object that contains addr; fills in its elem.
+static bool contains (AllocRecord *rec, void *addr, AllocTableElem &elem) {
+  void *start;
+  if (!readRecord(rec, start, elem) || !start)
+    return false;
+  char *cp = reinterpret_cast<char*>(addr);
+  char *sp = reinterpret_cast<char*>(start);
+  return cp == sp || (cp > sp && cp < sp + elem.size);
+}
+
+static AllocRecord *findMisaligned (void *addr, bool exact) {
+  AllocRecord *rec = NULL;
+  pthread_mutex_lock(&MisalignedLock);
+  auto it = MisalignedTable.upper_bound(addr);
+  if (it != MisalignedTable.begin()) {
+    --it;
+    if (!exact || it->first == addr)
+      rec = it->second;
+  }
+  pthread_mutex_unlock(&MisalignedLock);
+  return rec;
+}
+
+static AllocRecord *recordOf (uintptr_t slot) {
+  return reinterpret_cast<AllocRecord*>(slot & ~MisalignedBit);
+}
+
+// Allocation that contains addr, with its elem.
+static bool findAlloc (void* addr, AllocTableElem &elem) {
+  if (LastAlloc && contains(LastAlloc, addr, elem))
+    return true;
+
+  uintptr_t a = reinterpret_cast<uintptr_t>(addr);
+  uintptr_t e = GranuleShadow.load(a);
+  AllocRecord *rec = recordOf(e);
+  if (!e)
+    rec = recordOf(PageShadow.load(a));
+
+  if ((rec && contains(rec, addr, elem)) ||
+      ((e & MisalignedBit) && (rec = findMisaligned(addr, false)) && contains(rec, addr, elem))) {
+    DEBUG("addr %p in an object of %lu bytes\n\n", addr, elem.size);
+    LastAlloc = rec;
+    return true;
+  }
+  DEBUG("It might be a access to global or stack variable instead of heap access\n\n");
+  return false;
+}
+
+// Record of the live object that starts at addr, or NULL.
+static AllocRecord *findStart (void* addr) {
+  uintptr_t a = reinterpret_cast<uintptr_t>(addr);
+  AllocRecord *rec;
+  if (a & ((1ul << GRANULE_SHIFT) - 1)) {
+    rec = findMisaligned(addr, true);
+  } else {
+    uintptr_t e = GranuleShadow.load(a);
+    rec = recordOf(e ? e : PageShadow.load(a));
+  }
+  void *start;
+  AllocTableElem elem;
+  return rec && readRecord(rec, start, elem) && start == addr ? rec : NULL;
+}
+
+static void addMisaligned (AllocRecord *rec) {
+  pthread_mutex_lock(&MisalignedLock);
+  MisalignedTable[rec->addr] = rec;
+  pthread_mutex_unlock(&MisalignedLock);
+}
+
+static void indexGranule (uintptr_t g, AllocRecord *rec, uintptr_t start, bool insert) {
+  ShadowTable<GRANULE_SHIFT, 24>::Slot *e = GranuleShadow.slot(g, insert);
+  if (!e)
+    return;
+  uintptr_t cur = e->load(std::memory_order_relaxed);
+  uintptr_t self = reinterpret_cast<uintptr_t>(rec);
+  if (!insert) {
+    while (recordOf(cur) == rec &&
+           !e->compare_exchange_weak(cur, cur & MisalignedBit, std::memory_order_release))
+      ;
+    return;
+  }
+
+  while (true) {
+    AllocRecord *other = recordOf(cur);
+    uintptr_t next;
+    if (!other) {
+      next = self | (cur & MisalignedBit);
+    } else if (start > g) {
+      // rec starts inside the granule, after the object that covers it
+      addMisaligned(rec);
+      next = cur | MisalignedBit;
+    } else {
+      // the occupant started inside this granule; rec covers its first byte
+      addMisaligned(other);
+      next = self | MisalignedBit;
+    }
+    if (e->compare_exchange_weak(cur, next, std::memory_order_release))
+      return;
+  }
+}
+
+static void indexRange (uintptr_t lo, uintptr_t hi, AllocRecord *rec, uintptr_t start, bool insert) {
+  if (lo >= hi)
+    return;
+  for (uintptr_t g = lo >> GRANULE_SHIFT; g <= (hi - 1) >> GRANULE_SHIFT; ++g)
+    indexGranule(g << GRANULE_SHIFT, rec, start, insert);
+}
+
+static void indexPages (uintptr_t lo, uintptr_t hi, AllocRecord *rec, bool insert) {
+  uintptr_t self = reinterpret_cast<uintptr_t>(rec);
+  for (uintptr_t p = lo; p < hi; p += 1ul << PAGE_SHIFT) {
+    ShadowTable<PAGE_SHIFT, 20>::Slot *e = PageShadow.slot(p, insert);
+    if (!e)
+      continue;
+    uintptr_t cur = insert ? 0 : self;
+    e->compare_exchange_strong(cur, insert ? self : 0, std::memory_order_release);
+  }
+}
+
+static void indexAlloc (AllocRecord *rec, void *addr, uint64_t size, bool insert) {
+  uintptr_t start = reinterpret_cast<uintptr_t>(addr);
+  uintptr_t end = start + std::max<uint64_t>(size, 1);
+  uintptr_t midLo = start, midHi = start;
+  if (end - start > LARGE_OBJECT) {
+    uintptr_t page = (1ul << PAGE_SHIFT) - 1;
+    midLo = (start + page) & ~page;
+    midHi = end & ~page;
+  }
+  indexRange(start, midLo, rec, start, insert);
+  indexPages(midLo, midHi, rec, insert);
+  indexRange(midHi, end, rec, start, insert);
+}
+
+// Adds an object to the index, without an event.
+static void registerAlloc (void* addr, const AllocTableElem &elem) {
+  AllocRecord *rec = newRecord();
+  writeRecord(rec, addr, elem);
+  indexAlloc(rec, addr, elem.size, true);
+}
+
+static void insertAlloc (void* addr, AllocTableElem elem) {
+#ifdef OBJTRACE_REUSE
+  elem.time = nowNs();
+  countAlloc(elem);
+#endif
+  registerAlloc(addr, elem);
+  traceAllocEvent(TraceAlloc, addr, elem.size, elem.fullId);
+}
+
+// Removes the object that starts at addr from the index, without an event;
+// elem gets what was recorded for it.
+static bool unregisterAlloc (void* addr, AllocTableElem &elem) {
+  AllocRecord *rec = findStart(addr);
+  if (!rec)
+    return false;
+  elem = rec->elem;
+  indexAlloc(rec, addr, elem.size, false);
+  if (reinterpret_cast<uintptr_t>(addr) & ((1ul << GRANULE_SHIFT) - 1)) {
+    pthread_mutex_lock(&MisalignedLock);
+    auto it = MisalignedTable.find(addr);
+    if (it != MisalignedTable.end() && it->second == rec)
+      MisalignedTable.erase(it);
+    pthread_mutex_unlock(&MisalignedLock);
+  }
+  writeRecord(rec, NULL, AllocTableElem());
+  freeRecord(rec);
+  return true;
+}
+
+static void traceFree (void* addr, const AllocTableElem &elem) {
+  traceAllocEvent(TraceFree, addr, 0, elem.fullId);
+#ifdef OBJTRACE_REUSE
+  countFree(elem);
+#endif
+}
+
+// Forgets the allocation at addr; called before the memory goes back to the
+// allocator, so that nobody else can have registered it again yet.
+static bool eraseAlloc (void* addr) {
+  AllocTableElem elem;
+  if (!unregisterAlloc(addr, elem))
+    return false;
+  traceFree(addr, elem);
+  return true;
+}
+
+static inline void recordAccess (void *addr, uint64_t kind, FullID instrFullId, FullID allocFullId) {
+#if defined(OBJTRACE_DEPS)
+  (void) addr;
+  countAccess(kind, instrFullId, allocFullId);
+#elif defined(OBJTRACE_CACHESIM)
+  (void) kind, (void) instrFullId;
+  simulateAccess(addr, allocFullId);
+#elif defined(OBJTRACE_REUSE)
+  (void) kind, (void) instrFullId;
+  sampleReuse(addr, allocFullId);
+#else
+  traceEvent(reinterpret_cast<uint64_t>(addr) | kind, instrFullId, allocFullId, 0);
+#endif
+}
+
+// Mappings split by a partial munmap stay one object in the trace: the
+// pieces are indexed without events, and the mapping is freed, at its start
+// and with its allocation time, when its last piece is unmapped. The start
+// of every piece maps to the start of its mapping, which maps to the number
+// of pieces left.
+static std::map<uintptr_t, uintptr_t> MappingOfPiece;
+static std::map<uintptr_t, unsigned> MappingPieces;
+static pthread_mutex_t MappingLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Unregisters the mmap'd objects in [addr, addr + len), keeping the parts of
+// partially unmapped ones.
+static void forgetMappings (void* addr, size_t len) {
+  uintptr_t page = (1ul << PAGE_SHIFT) - 1;
+  uintptr_t lo = reinterpret_cast<uintptr_t>(addr) & ~page;
+  uintptr_t hi = (reinterpret_cast<uintptr_t>(addr) + len + page) & ~page;
+  for (uintptr_t p = lo; p < hi; p += 1ul << PAGE_SHIFT) {
+    AllocTableElem elem;
+    if (!findAlloc(reinterpret_cast<void*>(p), elem) || elem.kind != AllocMmap)
+      continue;
+    void *start;
+    if (!readRecord(LastAlloc, start, elem)) // LastAlloc is what findAlloc found
+      continue;
+    uintptr_t s = reinterpret_cast<uintptr_t>(start), e = s + elem.size;
+    if (!unregisterAlloc(start, elem))
+      continue;
+
+    pthread_mutex_lock(&MappingLock);
+    uintptr_t mapping = s;
+    unsigned pieces = 1;
+    auto piece = MappingOfPiece.find(s);
+    if (piece != MappingOfPiece.end()) {
+      mapping = piece->second;
+      pieces = MappingPieces[mapping];
+      MappingOfPiece.erase(piece);
+    }
+    --pieces;
+    if (s < lo) {
+      registerAlloc(start, {lo - s, elem.fullId, elem.align, AllocMmap, elem.time});
+      MappingOfPiece[s] = mapping;
+      ++pieces;
+    }
+    if (e > hi) {
+      registerAlloc(reinterpret_cast<void*>(hi), {e - hi, elem.fullId, elem.align, AllocMmap, elem.time});
+      MappingOfPiece[hi] = mapping;
+      ++pieces;
+    }
+    if (pieces)
+      MappingPieces[mapping] = pieces;
+    else
+      MappingPieces.erase(mapping);
+    pthread_mutex_unlock(&MappingLock);
+
+    if (!pieces)
+      traceFree(reinterpret_cast<void*>(mapping), elem);
+    p = std::max(p, std::min(e, hi) - (1ul << PAGE_SHIFT));
   }
-  fprintf(profOut, "##### OBJTRACE RUNTIME PROFILER FINALIZE #####\n");
 }
 
 extern "C"
 void objTraceLoadInstr (void* addr, FullID fullId) {
   DEBUG("RUNTIME: Load addr %p, fullId %lu\n", addr, fullId);
 
-  auto it = AllocTable.lower_bound(addr);
-  auto it2 = AllocTable.find(it->first);
-
-  DEBUG("LOAD: it lower_bound address is %p\n", it->first);
-
-  if (AllocTable.find(addr) != AllocTable.end()) {
-    DEBUG("LOAD: start address  %p\n\n", it2->first);
-    MemoryAccessHistoryTable.push_back({fullId, 0 ,AllocTable[addr].fullId, addr});
-  } else if (it->first != NULL) {
-    size_t distance = std::distance(AllocTable.begin(), it);
-    //DEBUG("LOAD: distance %zu\n", distance);
-    //assert(distance > 0 && "Distance should be larger than 0?");
-    size_t i = 0;
-    for (auto it3 : AllocTable) { // XXX: is it a best method?
-      if (distance == 0) {
-        DEBUG("STORE: It might be a access to global variable\n\n");
-        break;
-      } else if (i == distance-1) {
-        char *cp = reinterpret_cast<char*>(it3.first);
-        void *maxAddr = (void*)(cp + it3.second.size);
-        if (addr < maxAddr) {
-          // TODO: need another param as align and check it.
-          DEBUG("LOAD: addr %p ~ %p\n\n", it3.first, maxAddr);
-          MemoryAccessHistoryTable.push_back({fullId, 0, AllocTable[it3.first].fullId, addr});
-          break;
-        } else {
-          DEBUG("LOAD: It might be a access to stack variable instead of heap access\n\n");
-          break;
-        }
-      }
-      i++;
-    } // for
-  }
+  AllocTableElem elem;
+  if (findAlloc(addr, elem))
+    recordAccess(addr, 0, fullId, elem.fullId);
 }
 
 extern "C"
 void objTraceStoreInstr (void* addr, FullID fullId) {
   DEBUG("RUNTIME: Store addr %p, FullId %lu\n", addr, fullId);
 
-  auto it = AllocTable.lower_bound(addr);
-  auto it2 = AllocTable.find(it->first);
-
-  DEBUG("STORE: it lower_bound address is %p\n", it->first);
-
-  if (AllocTable.find(addr) != AllocTable.end()) {
-    DEBUG("STORE: start address %p\n\n", it2->first);
-    MemoryAccessHistoryTable.push_back({0, fullId, AllocTable[addr].fullId, addr});
-  } else if (it->first != NULL) {
-    size_t distance = std::distance(AllocTable.begin(), it);
-    //DEBUG("STORE: distance %zu\n", distance);
-    //assert(distance > 0 && "Distance should be lager than 0?");
-    size_t i = 0;
-    for (auto it3 : AllocTable) { // XXX: is it best method?
-      if (distance == 0) {
-        DEBUG("STORE: It might be a access to global variable\n\n");
-        break;
-      } else if (i == distance-1) {
-        char *cp = reinterpret_cast<char*>(it3.first);
-        void *maxAddr = (void*)(cp + it3.second.size);
-        if (addr < maxAddr) {
-          // TODO: need another param as align and check it.
-          DEBUG("STORE: addr %p ~ %p\n\n", it3.first, maxAddr);
-          MemoryAccessHistoryTable.push_back({0, fullId, AllocTable[it3.first].fullId, addr});
-          break;
-        } else {
-          DEBUG("STORE: It might be a access to stack variable instead of heap access\n\n");
-          break;
-        }
-      }
-      i++;
-    } // for
+  AllocTableElem elem;
+  if (findAlloc(addr, elem))
+    recordAccess(addr, TRACE_STORE, fullId, elem.fullId);
+}
+
+// The loads and stores of a block, in program order (opt -objtrace-batch-size).
+extern "C"
+void objTraceAccessBatch (ObjTraceAccess *accesses, uint64_t count) {
+  for (uint64_t i = 0; i < count; ++i) {
+    uint64_t kind = accesses[i].addr & TRACE_STORE;
+    void *addr = reinterpret_cast<void*>(accesses[i].addr & ~TRACE_STORE);
+    DEBUG("RUNTIME: %s addr %p, fullId %lu\n", kind ? "Store" : "Load", addr, accesses[i].instrFullId);
+
+    AllocTableElem elem;
+    if (findAlloc(addr, elem))
+      recordAccess(addr, kind, accesses[i].instrFullId, elem.fullId);
   }
 }
 
@@ -123,13 +1177,8 @@ extern "C" void*
 objTraceMalloc (size_t size, FullID fullId){
   void* addr = malloc (size);
   DEBUG("RUNTIME: malloc addr %p, fullId %lu\n\n", addr, fullId);
-  AllocTableElem elem = {size, fullId};
-  AllocTable[addr] = elem;
-  /*std::cout << "AllocTable:\n";
-  for(auto i = AllocTable.begin(); i != AllocTable.end(); ++i) {
-    std::cout << i->first << " " << i->second.size << " " << i->second.fullId << " / ";
-  }
-  std::cout << std::endl;*/
+  if (addr)
+    insertAlloc(addr, {size, fullId, MALLOC_ALIGN, AllocMalloc});
   return addr;
 }
 
@@ -137,48 +1186,171 @@ extern "C" void*
 objTraceCalloc (size_t num, size_t size, FullID fullId){
   void* addr = calloc (num, size);
   DEBUG("RUNTIME: calloc addr %p, num %zu, size %zu, fullId %lu\n\n", addr, num, size, fullId);
-  AllocTableElem elem = {num*size, fullId};
-  AllocTable[addr] = elem;
-  /*std::cout << "AllocTable:\n";
-  for(auto i = AllocTable.begin(); i != AllocTable.end(); ++i) {
-    std::cout << i->first << " " << i->second.size << " " << i->second.fullId << " / ";
-  }
-  std::cout << std::endl;*/
+  if (addr)
+    insertAlloc(addr, {num*size, fullId, MALLOC_ALIGN, AllocCalloc});
   return addr;
 }
 
-extern "C" void*
-objTraceRealloc (void* addr, size_t size, FullID fullId){
-  void* naddr = NULL;
-  naddr = realloc (addr, size);
-  DEBUG("RUNTIME: realloc addr %p, naddr %p, size %zu, fullID %lu\n\n", addr, naddr, size, fullId);
-  //auto it = std::find_if(AllocTable.begin(),
-  //                       AllocTable.end(),
-  //                       [&addr](AllocTableElem& elem){ return (elem.addr == addr); });
-  assert((AllocTable.find(addr) != AllocTable.end()) \
+// realloc through reallocate(addr, size)
+template <typename Reallocate>
+static void* traceRealloc (void* addr, size_t size, FullID fullId, Reallocate reallocate){
+  AllocTableElem old = {0, fullId, MALLOC_ALIGN, AllocMalloc};
+  AllocRecord *rec = addr ? findStart(addr) : NULL;
+  assert((!addr || rec) \
          && "Something wrong! Realloc have to be called after Malloc or Calloc is called.");
-  AllocTable.erase(addr);
-  AllocTable[naddr] = {size, fullId};
-  /*std::cout << "AllocTable:\n";
-  for(auto i = AllocTable.begin(); i != AllocTable.end(); ++i) {
-    std::cout << i->first << " " << i->second.size << " " << i->second.fullId << " / ";
+  if (rec) {
+    void *start;
+    readRecord(rec, start, old);
+    eraseAlloc(addr);
   }
-  std::cout << std::endl;*/
+
+  void* naddr = reallocate (addr, size);
+  DEBUG("RUNTIME: realloc addr %p, naddr %p, size %zu, fullID %lu\n\n", addr, naddr, size, fullId);
+  if (naddr)
+    insertAlloc(naddr, {size, fullId, MALLOC_ALIGN, AllocRealloc});
+  else if (addr && size)
+    insertAlloc(addr, old); // failed, the old block is still there
   return naddr;
 }
 
+extern "C" void*
+objTraceRealloc (void* addr, size_t size, FullID fullId){
+  return traceRealloc(addr, size, fullId, [](void* addr, size_t size) {
+    return realloc (addr, size);
+  });
+}
+
 extern "C" void
 objTraceFree (void* addr, FullID fullId){
-  free (addr);
   DEBUG("RUNTIME: free addr %p, fullId %lu\n\n", addr, fullId);
-  //AllocTable.erase(std::remove_if(AllocTable.begin(),
-  //           AllocTable.end(),
-  //           [addr](AllocTableElem& elem){ return (elem.addr == addr); }), AllocTable.end());
-  assert((AllocTable.find(addr) != AllocTable.end()) && "Something Wrong! Free should have a address which was surely allocated before.");
-  AllocTable.erase(addr);
-  /*std::cout << "AllocTable:\n";
-  for(auto i = AllocTable.begin(); i != AllocTable.end(); ++i) {
-    std::cout << i->first << " " << i->second.size << " " << i->second.fullId << " / ";
-  }
-  std::cout << std::endl;*/
+  bool known = !addr || eraseAlloc(addr);
+  assert(known && "Something Wrong! Free should have a address which was surely allocated before.");
+  (void) known;
+  free (addr);
+}
+
+// Calls rewritten by opt -objarena: the objects come from the arenas of
+// tools/objarena instead of libc.
+extern "C" void*
+objTraceArenaMalloc (size_t size, uint32_t arena, FullID fullId){
+  void* addr = objArenaMalloc (size, arena);
+  DEBUG("RUNTIME: arena malloc addr %p, arena %x, fullId %lu\n\n", addr, arena, fullId);
+  if (addr)
+    insertAlloc(addr, {size, fullId, MALLOC_ALIGN, AllocMalloc});
+  return addr;
+}
+
+extern "C" void*
+objTraceArenaCalloc (size_t num, size_t size, uint32_t arena, FullID fullId){
+  void* addr = objArenaCalloc (num, size, arena);
+  DEBUG("RUNTIME: arena calloc addr %p, num %zu, size %zu, arena %x, fullId %lu\n\n",
+        addr, num, size, arena, fullId);
+  if (addr)
+    insertAlloc(addr, {num*size, fullId, MALLOC_ALIGN, AllocCalloc});
+  return addr;
+}
+
+extern "C" void*
+objTraceArenaRealloc (void* addr, size_t size, uint32_t arena, FullID fullId){
+  return traceRealloc(addr, size, fullId, [arena](void* addr, size_t size) {
+    return objArenaRealloc (addr, size, arena);
+  });
+}
+
+extern "C" void
+objTraceArenaFree (void* addr, FullID fullId){
+  DEBUG("RUNTIME: arena free addr %p, fullId %lu\n\n", addr, fullId);
+  bool known = !addr || eraseAlloc(addr);
+  assert(known && "Something Wrong! Free should have a address which was surely allocated before.");
+  (void) known;
+  objArenaFree (addr);
+}
+
+extern "C" void*
+objTraceNew (size_t size, uint32_t kind, FullID fullId){
+  void *addr;
+  switch (kind) {
+  case AllocNewArray: addr = ::operator new[](size); break;
+  case AllocNewNothrow: addr = ::operator new(size, std::nothrow); break;
+  case AllocNewArrayNothrow: addr = ::operator new[](size, std::nothrow); break;
+  default: addr = ::operator new(size); break;
+  }
+  DEBUG("RUNTIME: new addr %p, size %zu, kind %u, fullId %lu\n\n", addr, size, kind, fullId);
+  if (addr)
+    insertAlloc(addr, {size, fullId, MALLOC_ALIGN,
+                       kind == AllocNewNothrow ? (uint32_t) AllocNew :
+                       kind == AllocNewArrayNothrow ? (uint32_t) AllocNewArray : kind});
+  return addr;
+}
+
+extern "C" void
+objTraceDelete (void* addr, uint32_t kind, FullID fullId){
+  DEBUG("RUNTIME: delete addr %p, kind %u, fullId %lu\n\n", addr, kind, fullId);
+  bool known = !addr || eraseAlloc(addr);
+  assert(known && "Something Wrong! Delete should have a address which was surely allocated before.");
+  (void) known;
+  if (kind == AllocNewArray)
+    ::operator delete[](addr);
+  else
+    ::operator delete(addr);
+}
+
+extern "C" char*
+objTraceStrdup (const char* s, FullID fullId){
+  char* addr = strdup (s);
+  DEBUG("RUNTIME: strdup addr %p, fullId %lu\n\n", addr, fullId);
+  if (addr)
+    insertAlloc(addr, {strlen(addr) + 1, fullId, MALLOC_ALIGN, AllocStrdup});
+  return addr;
+}
+
+extern "C" char*
+objTraceStrndup (const char* s, size_t n, FullID fullId){
+  char* addr = strndup (s, n);
+  DEBUG("RUNTIME: strndup addr %p, fullId %lu\n\n", addr, fullId);
+  if (addr)
+    insertAlloc(addr, {strlen(addr) + 1, fullId, MALLOC_ALIGN, AllocStrdup});
+  return addr;
+}
+
+// aligned_alloc and memalign
+extern "C" void*
+objTraceAlignedAlloc (size_t align, size_t size, uint32_t kind, FullID fullId){
+  void* addr = kind == AllocAlignedAlloc ? aligned_alloc (align, size) : memalign (align, size);
+  DEBUG("RUNTIME: aligned alloc addr %p, align %zu, size %zu, fullId %lu\n\n", addr, align, size, fullId);
+  if (addr)
+    insertAlloc(addr, {size, fullId, (uint32_t) std::max<size_t>(align, MALLOC_ALIGN), kind});
+  return addr;
+}
+
+extern "C" int
+objTracePosixMemalign (void** ptr, size_t align, size_t size, FullID fullId){
+  int err = posix_memalign (ptr, align, size);
+  DEBUG("RUNTIME: posix_memalign addr %p, align %zu, size %zu, fullId %lu\n\n",
+        err ? NULL : *ptr, align, size, fullId);
+  if (!err && *ptr)
+    insertAlloc(*ptr, {size, fullId, (uint32_t) std::max<size_t>(align, MALLOC_ALIGN), AllocPosixMemalign});
+  return err;
+}
+
+extern "C" void*
+objTraceMmap (void* addr, size_t len, int prot, int flags, int fd, off_t off, FullID fullId){
+  void* naddr = mmap (addr, len, prot, flags, fd, off);
+  DEBUG("RUNTIME: mmap addr %p, len %zu, fullId %lu\n\n", naddr, len, fullId);
+  if (naddr != MAP_FAILED) {
+    // MAP_FIXED may have replaced other mappings
+    if (flags & MAP_FIXED)
+      forgetMappings(naddr, len);
+    insertAlloc(naddr, {len, fullId, 1u << PAGE_SHIFT, AllocMmap});
+  }
+  return naddr;
+}
+
+extern "C" int
+objTraceMunmap (void* addr, size_t len, FullID fullId){
+  DEBUG("RUNTIME: munmap addr %p, len %zu, fullId %lu\n\n", addr, len, fullId);
+  int err = munmap (addr, len);
+  if (!err)
+    forgetMappings(addr, len);
+  return err;
 }
@@ -3,36 +3,193 @@
 
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
-#define DEBUG
+#include "objtraceformat.h"
 
-#ifdef DEBUG
+// build with -DOBJTRACE_DEBUG to log every event to stderr; otherwise the
+// arguments are only type-checked
+#ifdef OBJTRACE_DEBUG
   #define DEBUG(fmt, ...) fprintf(stderr, "DEBUG: %s(): " fmt, \
       __func__, ##__VA_ARGS__)
 #else
-  #define DEBUG(fmt, ...)
+  #define DEBUG(fmt, ...) do { if (0) fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
 #endif
 
-typedef uint16_t InstrID;
-typedef uint64_t FullID;
+// One mode per build: the trace (default), -DOBJTRACE_DEPS,
+// -DOBJTRACE_CACHESIM or -DOBJTRACE_REUSE.
+#if defined(OBJTRACE_DEPS) + defined(OBJTRACE_CACHESIM) + defined(OBJTRACE_REUSE) > 1
+#error "OBJTRACE_DEPS, OBJTRACE_CACHESIM and OBJTRACE_REUSE are exclusive"
+#endif
+#if !defined(OBJTRACE_DEPS) && !defined(OBJTRACE_CACHESIM) && !defined(OBJTRACE_REUSE)
+#define OBJTRACE_TRACE
+#endif
+
+// How an object was allocated. lib/ObjTrace/ObjTrace.cpp passes the kinds of
+// new, memalign and aligned_alloc by number.
+enum AllocKind {
+  AllocMalloc,
+  AllocCalloc,
+  AllocRealloc,
+  AllocNew,
+  AllocNewArray,
+  AllocNewNothrow,      // recorded as AllocNew
+  AllocNewArrayNothrow, // recorded as AllocNewArray
+  AllocStrdup,
+  AllocMemalign,
+  AllocAlignedAlloc,
+  AllocPosixMemalign,
+  AllocMmap
+};
+
+static_assert(AllocNew == 3 && AllocNewArray == 4 && AllocNewNothrow == 5 &&
+              AllocNewArrayNothrow == 6 && AllocMemalign == 8 && AllocAlignedAlloc == 9,
+              "AllocKind numbers differ from the ones of the ObjTrace pass");
+
+#define MALLOC_ALIGN (2 * sizeof(size_t))
 
 struct AllocTableElem {
   uint64_t size;
   FullID fullId;
+  uint32_t align;
+  uint32_t kind; // AllocKind
+  uint64_t time; // of the allocation, with -DOBJTRACE_REUSE
+
+  AllocTableElem () : size(0), fullId(0), align(0), kind(0), time(0) {}
+  AllocTableElem (uint64_t size, FullID fullId, uint32_t align, uint32_t kind, uint64_t time = 0)
+    : size(size), fullId(fullId), align(align), kind(kind), time(time) {}
 };
 
-struct MemoryAccessHistoryTableElem {
-  FullID loadFullId;
-  FullID storeFullId;
+// One event on its way to the trace file: the kind is in the top bits of
+// addr, value is the instruction of an access or the size of an allocation.
+struct TraceRecord {
+  uint64_t addr;
+  uint64_t value;
   FullID allocFullId;
+  uint64_t time;
+};
+
+// One access of an objTraceAccessBatch call, laid out as the pass builds it.
+struct ObjTraceAccess {
+  uint64_t addr; // TRACE_STORE set for stores
+  FullID instrFullId;
+};
+
+// Dependence profile: open-addressed table of one thread; an entry with no
+// accesses is empty. Tables of exited threads are reused by new threads, as
+// rings are.
+#ifndef OBJTRACE_DEPS_ENTRIES
+#define OBJTRACE_DEPS_ENTRIES (1 << 12) // initial size, a power of two
+#endif
+
+struct DepTable {
+  std::atomic<bool> owned;
+  DepTable *next;
+  uint64_t mask;
+  uint64_t used;
+  DepEntry *entries;
+};
+
+// Cache simulation: one thread's model of the hierarchy, and its misses per
+// allocation site. Models of exited threads are reused, warm, by new ones.
+#define OBJTRACE_CACHE_LEVELS 3
+
+struct CacheLevel {
+  uint64_t sets;
+  unsigned ways;
+  uint64_t *tags; // line numbers, most recently used first in each set
+};
+
+struct SiteMisses {
+  uint64_t accesses;
+  uint64_t misses[OBJTRACE_CACHE_LEVELS];
+};
+
+struct CacheSim {
+  std::atomic<bool> owned;
+  CacheSim *next;
+  CacheLevel levels[OBJTRACE_CACHE_LEVELS];
+  std::unordered_map<FullID, SiteMisses> sites;
+  SiteMisses *lastSite; // sites[lastSiteId]
+  FullID lastSiteId;
+};
+
+// Locality profile: log2 histograms per allocation site, and the sampled
+// lines of one thread's reuse-distance computation (see objtraceruntime.cpp).
+#define HIST_BUCKETS 48
+
+struct Histogram {
+  uint64_t count;
+  uint64_t never; // reuse only: lines not seen before
+  uint64_t buckets[HIST_BUCKETS]; // [i] counts values in [2^(i-1), 2^i)
+};
+
+struct SiteLocality {
+  Histogram reuse; // distance in distinct lines
+  Histogram size;  // bytes
+  Histogram life;  // nanoseconds
+};
+
+struct ReuseSampler {
+  std::atomic<bool> owned;
+  ReuseSampler *next;
+  uint32_t threshold; // lines whose hash is below are sampled
+  uint64_t now;       // sampled accesses so far, modulo compaction
+  std::unordered_map<uint64_t, uint64_t> last; // sampled line -> time of its last access
+  std::set<std::pair<uint32_t, uint64_t> > byHash; // sampled lines, by hash
+  std::vector<uint32_t> marks; // Fenwick tree, 1 at the times in last
+  std::unordered_map<FullID, SiteLocality> sites;
+  SiteLocality *lastSite; // sites[lastSiteId]
+  FullID lastSiteId;
+};
+
+// Records of one thread on their way to the trace file. Only the owning
+// thread moves head and only the flusher moves tail; a thread waits for the
+// flusher when its ring is full. Rings of exited threads are reused once
+// they are drained, so memory stays bounded by the peak number of threads.
+#ifndef OBJTRACE_RING_RECORDS
+#define OBJTRACE_RING_RECORDS (1 << 16)
+#endif
+
+struct TraceRing {
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  std::atomic<bool> owned;
+  uint32_t tid;
+  TraceRing *next;
+  TraceRecord records[OBJTRACE_RING_RECORDS];
+};
+
+// One allocation of the index (see objtraceruntime.cpp). seq is odd while
+// the record is being rewritten; addr is NULL once the object is freed.
+struct AllocRecord {
+  std::atomic<uint64_t> seq;
   void *addr;
+  AllocTableElem elem;
+  AllocRecord *nextFree;
 };
 
-auto pred = [](const void *e1, const void *e2) -> bool { return e1 < e2; };
-std::map<void *, struct AllocTableElem, decltype(pred)> AllocTable(pred); // This table is always sorted with ascending order of key (addr) 
-std::vector<struct MemoryAccessHistoryTableElem> MemoryAccessHistoryTable;
+typedef std::map<void *, AllocRecord *> AllocTableTy;
+AllocTableTy MisalignedTable; // objects that start inside another's granule
+pthread_mutex_t MisalignedLock = PTHREAD_MUTEX_INITIALIZER;
+
+std::atomic<TraceRing *> TraceRings(NULL); // every ring ever created
+static __thread TraceRing *MyRing = NULL;
+
+std::atomic<DepTable *> DepTables(NULL); // every dependence table ever created
+static __thread DepTable *MyDeps = NULL;
+
+std::atomic<CacheSim *> CacheSims(NULL); // every cache model ever created
+static __thread CacheSim *MySim = NULL;
 
-FILE *profOut;
+std::atomic<ReuseSampler *> ReuseSamplers(NULL); // every sampler ever created
+static __thread ReuseSampler *MyReuse = NULL;
 
 #endif
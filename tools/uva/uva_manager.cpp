@@ -12,6 +12,7 @@
 #include <cassert>
 #include <inttypes.h>
 #include <vector>
+#include <algorithm>
 #include <sys/mman.h>
 #include <stdint.h>
 
@@ -59,10 +60,20 @@ namespace corelab {
 		static UVAOwnership uvaown;
 		static PageSet setMEPages;
 
-    static std::vector<struct StoreLog*> *vecCriticalSectionStoreLogs;
-    static std::vector<struct StoreLog*> *vecStoreLogs;
-    static int sizeCriticalSectionStoreLogs = 0;
-    static int sizeStoreLogs = 0;
+    /* Store logs of HLRC, kept in the wire format of the sync and release
+     * requests: records of {int32 size, size bytes of data, uint32 addr}
+     * appended to one growable buffer, which is sent as it is. */
+    struct StoreLogBuffer {
+      char *data;
+      size_t size;
+      size_t capacity;
+    };
+    static const size_t STORE_LOG_INITIAL_CAPACITY = 64 * 1024;
+    static const size_t STORE_LOG_RECORD_MAX = 64 * 1024; // data bytes; larger stores are split
+    static const size_t STORE_LOG_MESSAGE_MAX = Q_MAX - 8; // record bytes behind the request words
+
+    static StoreLogBuffer criticalSectionStoreLogs;
+    static StoreLogBuffer storeLogs;
     static bool isInCriticalSection = false;
 
     // BONGJUN
@@ -100,6 +111,9 @@ namespace corelab {
 		#endif
 
     static inline uint32_t makeInt32Addr(void *addr);
+    static inline char *appendStoreLog(size_t size, void *addr);
+    static size_t storeLogMessage(StoreLogBuffer &log, size_t offset);
+    static uint32_t invalidateAddresses(CommManager *comm, uint32_t destid);
     /* not exact */
     static inline bool isUVAaddr(void *addr);
     static inline bool isUVAheapAddr(uint32_t intAddr);
@@ -121,8 +135,6 @@ namespace corelab {
       //xmemInitialize(socket); // above from gwangmu implmentation. but I want to use
 
       xmemInitialize(comm, destid); // above from gwangmu implmentation. but I want to use
-      vecCriticalSectionStoreLogs = new vector<struct StoreLog*>;
-      vecStoreLogs = new vector<struct StoreLog*>;
 			setMEPages.clear ();
 			//uvaown = _uvaown;
       //socket = socket;
@@ -171,31 +183,11 @@ namespace corelab {
 #endif
       
       // recv invalidate address list.
-      comm->receiveQue(destid);
 #ifdef DEBUG_UVA
-      LOG("[client] recv address list\n");
-#endif
-
-      //int addressSize = socket->takeWordF();
-      uint32_t addressNum = comm->takeWord(destid);
-      vector<void*> addressVector;
-      //void** addressbuf = (void **) malloc(addressSize);
-      void** addressbuf = (void **) malloc(4);
-      for(int i = 0; i < addressNum; i++) {
-        //socket->takeRangeF(addressbuf, addressSize);
-        comm->takeRange(addressbuf, 4, destid);
-        addressVector.push_back(*addressbuf);
-      }
-      free(addressbuf);
-      // all address invalidate.
-      
-      for(vector<void*>::iterator it = addressVector.begin(); it != addressVector.end(); it++) {
-        void* address = *it;
-#ifdef DEBUG_UVA
-        LOG("invalidate address : %p\n", address);
+      uint32_t addressNum = invalidateAddresses(comm, destid);
+#else
+      invalidateAddresses(comm, destid);
 #endif
-        mprotect(truncToPageAddr(address), PAGE_SIZE, PROT_NONE);
-      }
 
       isInCriticalSection = true;
 #ifdef DEBUG_UVA
@@ -205,48 +197,19 @@ namespace corelab {
 
     /* @detail HLRC (Home-based Lazy Release Consistency): release */
     void UVAManager::releaseHandler_hlrc(CommManager *comm, uint32_t destid) {
-      /* At first, make store logs to be send to Home */
-      void *storeLogs = malloc(sizeCriticalSectionStoreLogs);
-#if UINTPTR_MAX == 0xffffffff
-      /* 32-bit */
-      uint32_t intAddrOfStoreLogs;
-      memcpy(&intAddrOfStoreLogs, &storeLogs, 4); 
-      uint32_t current = intAddrOfStoreLogs;
-#elif UINTPTR_MAX == 0xffffffffffffffff
-      /* 64-bit */
-      uint64_t intAddrOfStoreLogs;
-      memcpy(&intAddrOfStoreLogs, &storeLogs, 8); 
-      uint64_t current = intAddrOfStoreLogs;
-#else
-      /* hmm ... */
-      assert(0);
-#endif
-      int i = 0;
-      while (current != intAddrOfStoreLogs + sizeStoreLogs) {
-        struct StoreLog* curStoreLog = (*vecCriticalSectionStoreLogs)[i];
+      /* Send the store logs to Home, straight from the log */
 #ifdef DEBUG_UVA
-        LOG("[client] CRITICAL SECTION in while | curStoreLog (size:%d, data:%p, data:%d, addr:%p)\n", curStoreLog->size, curStoreLog->data, *((int*)curStoreLog->data), curStoreLog->addr);
-#endif        
-        uint32_t intAddr;
-        memcpy(reinterpret_cast<void*>(current), &curStoreLog->size, 4);
-        memcpy(reinterpret_cast<void*>(current+4), curStoreLog->data, curStoreLog->size);
-        memcpy(&intAddr, &curStoreLog->addr, 4);
-        memcpy(reinterpret_cast<void*>(current+4+curStoreLog->size), &intAddr, 4);
-        current = current + 8 + curStoreLog->size;
-        //free(curStoreLog->data);
-        i++;
-      }
-#ifdef DEBUG_UVA
-      LOG("[client] CRITICAL SECTION # of vecStoreLogs %d | sizeStoreLogs %d\n", vecCriticalSectionStoreLogs->size(), sizeCriticalSectionStoreLogs);
+      LOG("[client] CRITICAL SECTION sizeStoreLogs %zu\n", criticalSectionStoreLogs.size);
 #endif 
-      /* Second, send them all */
-      comm->pushWord(RELEASE_HANDLER, RELEASE_REQ, destid);
-      comm->pushWord(RELEASE_HANDLER, sizeCriticalSectionStoreLogs, destid);
-      comm->pushRange(RELEASE_HANDLER, storeLogs, sizeCriticalSectionStoreLogs, destid);
-      comm->sendQue(RELEASE_HANDLER, destid);
-      sizeCriticalSectionStoreLogs = 0;
-      free(storeLogs);
-      vecCriticalSectionStoreLogs->clear();
+      size_t sent = 0;
+      do {
+        size_t size = storeLogMessage(criticalSectionStoreLogs, sent);
+        comm->pushWord(RELEASE_HANDLER, RELEASE_REQ, destid);
+        comm->pushWord(RELEASE_HANDLER, size, destid);
+        comm->sendQue(RELEASE_HANDLER, criticalSectionStoreLogs.data + sent, size, destid);
+        sent += size;
+      } while (sent < criticalSectionStoreLogs.size);
+      criticalSectionStoreLogs.size = 0;
       isInCriticalSection = false;
     }
 
@@ -256,79 +219,29 @@ namespace corelab {
       StopWatch watch;
       watch.start();
 #endif
-      /* At first, make store logs to be send to Home */
-      void *storeLogs = malloc(sizeStoreLogs);
-#if UINTPTR_MAX == 0xffffffff
-      /* 32-bit */
-      uint32_t intAddrOfStoreLogs;
-      memcpy(&intAddrOfStoreLogs, &storeLogs, 4); 
-      uint32_t current = intAddrOfStoreLogs;
-#elif UINTPTR_MAX == 0xffffffffffffffff
-      /* 64-bit */
-      uint64_t intAddrOfStoreLogs;
-      memcpy(&intAddrOfStoreLogs, &storeLogs, 8); 
-      uint64_t current = intAddrOfStoreLogs;
-#else
-      /* hmm ... */
-      assert(0);
-#endif
-      int i = 0;
-      while (current != intAddrOfStoreLogs + sizeStoreLogs) {
-        struct StoreLog* curStoreLog = (*vecStoreLogs)[i];
+      /* Send the store logs to Home, straight from the log, and invalidate
+       * the addresses each reply lists. A log larger than a message goes in
+       * several requests. */
 #ifdef DEBUG_UVA
-        LOG("[client] in while | curStoreLog (size:%d, data:%p, data:%d, addr:%p)\n", curStoreLog->size, curStoreLog->data, *((int*)curStoreLog->data), curStoreLog->addr);
-#endif        
-        uint32_t intAddr;
-        memcpy(reinterpret_cast<void*>(current), &curStoreLog->size, 4);
-        memcpy(reinterpret_cast<void*>(current+4), curStoreLog->data, curStoreLog->size);
-        memcpy(&intAddr, &curStoreLog->addr, 4);
-        memcpy(reinterpret_cast<void*>(current+4+curStoreLog->size), &intAddr, 4);
-        current = current + 8 + curStoreLog->size;
-        //free(curStoreLog->data);
-        i++;
-      }
-#ifdef DEBUG_UVA
-      LOG("[client] # of vecStoreLogs %d | sizeStoreLogs %d\n", vecStoreLogs->size(), sizeStoreLogs);
+      LOG("[client] sizeStoreLogs %zu\n", storeLogs.size);
 #endif 
-      /* Second, send them all */
-      //comm->pushWord(SYNC_HANDLER, SYNC_REQ, destid);
-      comm->pushWord(SYNC_HANDLER, sizeStoreLogs, destid);
-      if (sizeStoreLogs != 0)
-        comm->pushRange(SYNC_HANDLER, storeLogs, sizeStoreLogs, destid);
-      comm->sendQue(SYNC_HANDLER, destid);
-      sizeStoreLogs = 0;
-      free(storeLogs);
-      vecStoreLogs->clear(); // XXX
-
-      /* Third, recv invalidate address list. */
-      //StopWatch watch_recv;
-      //watch_recv.start();
-      comm->receiveQue(destid);
-      //watch_recv.end();
-      //LOG("\n\n\n receiveQue in sync handler : %f\n\n\n",watch_recv.diff());
-#ifdef DEBUG_UVA
-      LOG("[client] recv address list\n");
-#endif
-      //int addressSize = socket->takeWordF(); // XXX: Currently, out UVA address space is 32 bits.
-      uint32_t addressNum = comm->takeWord(destid);
-      vector<void*> addressVector;
-      //void** addressbuf = (void **) malloc(addressSize);
-      void** addressbuf = (void **) malloc(4);
-      for(int i = 0; i < addressNum; i++) {
-        //socket->takeRangeF(addressbuf, addressSize);
-        comm->takeRange(addressbuf, 4, destid);
-        addressVector.push_back(*addressbuf);
-      }
-      free(addressbuf);
-      // all address invalidate.
-      
-      for(vector<void*>::iterator it = addressVector.begin(); it != addressVector.end(); it++) {
-        void* address = *it;
-#ifdef DEBUG_UVA
-        //LOG("invalidate address : %p\n", address);
-#endif
-        mprotect(truncToPageAddr(address), PAGE_SIZE, PROT_NONE);
-      }
+      size_t sizeStoreLogs = storeLogs.size;
+      uint32_t addressNum = 0;
+      size_t sent = 0;
+      do {
+        size_t size = storeLogMessage(storeLogs, sent);
+        //comm->pushWord(SYNC_HANDLER, SYNC_REQ, destid);
+        comm->pushWord(SYNC_HANDLER, size, destid);
+        comm->sendQue(SYNC_HANDLER, storeLogs.data + sent, size, destid);
+        sent += size;
+
+        //StopWatch watch_recv;
+        //watch_recv.start();
+        addressNum += invalidateAddresses(comm, destid);
+        //watch_recv.end();
+        //LOG("\n\n\n receiveQue in sync handler : %f\n\n\n",watch_recv.diff());
+      } while (sent < storeLogs.size);
+      storeLogs.size = 0;
 
       //isInCriticalSection = true;
 #ifdef DEBUG_UVA
@@ -338,7 +251,7 @@ namespace corelab {
       watch.end();
       FILE *fp = fopen("uva-eval.txt", "a");
       //fprintf(fp, "RECVQ %lf\n",watch_recv.diff());
-      fprintf(fp, "SYNC %lf %d\n", watch.diff(), 8 + sizeStoreLogs + 4 + (4 *addressNum));
+      fprintf(fp, "SYNC %lf %zu\n", watch.diff(), 8 + sizeStoreLogs + 4 + (4 *addressNum));
       fclose(fp);
 #endif
     }
@@ -349,79 +262,29 @@ namespace corelab {
       StopWatch watch;
       watch.start();
 #endif
-      /* At first, make store logs to be send to Home */
-      void *storeLogs = malloc(sizeStoreLogs);
-#if UINTPTR_MAX == 0xffffffff
-      /* 32-bit */
-      uint32_t intAddrOfStoreLogs;
-      memcpy(&intAddrOfStoreLogs, &storeLogs, 4); 
-      uint32_t current = intAddrOfStoreLogs;
-#elif UINTPTR_MAX == 0xffffffffffffffff
-      /* 64-bit */
-      uint64_t intAddrOfStoreLogs;
-      memcpy(&intAddrOfStoreLogs, &storeLogs, 8); 
-      uint64_t current = intAddrOfStoreLogs;
-#else
-      /* hmm ... */
-      assert(0);
-#endif
-      int i = 0;
-      while (current != intAddrOfStoreLogs + sizeStoreLogs) {
-        struct StoreLog* curStoreLog = (*vecStoreLogs)[i];
-#ifdef DEBUG_UVA
-        LOG("[client] in while | curStoreLog (size:%d, data:%p, data:%d, addr:%p)\n", curStoreLog->size, curStoreLog->data, *((int*)curStoreLog->data), curStoreLog->addr);
-#endif        
-        uint32_t intAddr;
-        memcpy(reinterpret_cast<void*>(current), &curStoreLog->size, 4);
-        memcpy(reinterpret_cast<void*>(current+4), curStoreLog->data, curStoreLog->size);
-        memcpy(&intAddr, &curStoreLog->addr, 4);
-        memcpy(reinterpret_cast<void*>(current+4+curStoreLog->size), &intAddr, 4);
-        current = current + 8 + curStoreLog->size;
-        //free(curStoreLog->data);
-        i++;
-      }
+      /* Send the store logs to Home, straight from the log, and invalidate
+       * the addresses each reply lists. A log larger than a message goes in
+       * several requests. */
 #ifdef DEBUG_UVA
-      LOG("[client] # of vecStoreLogs %d | sizeStoreLogs %d\n", vecStoreLogs->size(), sizeStoreLogs);
+      LOG("[client] sizeStoreLogs %zu\n", storeLogs.size);
 #endif 
-      /* Second, send them all */
-      //comm->pushWord(SYNC_HANDLER, SYNC_REQ, destid);
-      comm->pushWord(SYNC_HANDLER, sizeStoreLogs, destid);
-      if (sizeStoreLogs != 0)
-        comm->pushRange(SYNC_HANDLER, storeLogs, sizeStoreLogs, destid);
-      comm->sendQue(SYNC_HANDLER, destid);
-      sizeStoreLogs = 0;
-      free(storeLogs);
-      vecStoreLogs->clear(); // XXX
-
-      /* Third, recv invalidate address list. */
-      //StopWatch watch_recv;
-      //watch_recv.start();
-      comm->receiveQue(destid);
-      //watch_recv.end();
-      //LOG("\n\n\n receiveQue in sync handler : %f\n\n\n",watch_recv.diff());
-#ifdef DEBUG_UVA
-      LOG("[client] recv address list\n");
-#endif
-      //int addressSize = socket->takeWordF(); // XXX: Currently, out UVA address space is 32 bits.
-      uint32_t addressNum = comm->takeWord(destid);
-      vector<void*> addressVector;
-      //void** addressbuf = (void **) malloc(addressSize);
-      void** addressbuf = (void **) malloc(4);
-      for(int i = 0; i < addressNum; i++) {
-        //socket->takeRangeF(addressbuf, addressSize);
-        comm->takeRange(addressbuf, 4, destid);
-        addressVector.push_back(*addressbuf);
-      }
-      free(addressbuf);
-      // all address invalidate.
-      
-      for(vector<void*>::iterator it = addressVector.begin(); it != addressVector.end(); it++) {
-        void* address = *it;
-#ifdef DEBUG_UVA
-        //LOG("invalidate address : %p\n", address);
-#endif
-        mprotect(truncToPageAddr(address), PAGE_SIZE, PROT_NONE);
-      }
+      size_t sizeStoreLogs = storeLogs.size;
+      uint32_t addressNum = 0;
+      size_t sent = 0;
+      do {
+        size_t size = storeLogMessage(storeLogs, sent);
+        //comm->pushWord(SYNC_HANDLER, SYNC_REQ, destid);
+        comm->pushWord(SYNC_HANDLER, size, destid);
+        comm->sendQue(SYNC_HANDLER, storeLogs.data + sent, size, destid);
+        sent += size;
+
+        //StopWatch watch_recv;
+        //watch_recv.start();
+        addressNum += invalidateAddresses(comm, destid);
+        //watch_recv.end();
+        //LOG("\n\n\n receiveQue in sync handler : %f\n\n\n",watch_recv.diff());
+      } while (sent < storeLogs.size);
+      storeLogs.size = 0;
 
       //isInCriticalSection = true;
 #ifdef DEBUG_UVA
@@ -431,7 +294,7 @@ namespace corelab {
       watch.end();
       FILE *fp = fopen("uva-eval.txt", "a");
       //fprintf(fp, "RECVQ %lf\n",watch_recv.diff());
-      fprintf(fp, "SYNC %lf %d\n", watch.diff(), 8 + sizeStoreLogs + 4 + (4 *addressNum));
+      fprintf(fp, "SYNC %lf %zu\n", watch.diff(), 8 + sizeStoreLogs + 4 + (4 *addressNum));
       fclose(fp);
 #endif
     }
@@ -572,19 +435,8 @@ namespace corelab {
       LOG("[client] in storeLog (size:%d, addr:%p, data:%p)\n", typeLen, addr, data);
 #endif
 
-      void *tmpData = malloc(typeLen);
-      memcpy(tmpData, &data, typeLen);
-#ifdef DEBUG_UVA
-      //LOG("[client] tmpData (data:%d)\n", *((int*)tmpData));
-#endif
-      struct StoreLog* slog = new StoreLog (static_cast<int>(typeLen), tmpData, addr);
-      if(!isInCriticalSection) {
-        vecStoreLogs->push_back(slog);
-        sizeStoreLogs = sizeStoreLogs + 8 + typeLen;
-      } else {
-        vecCriticalSectionStoreLogs->push_back(slog);
-        sizeCriticalSectionStoreLogs = sizeCriticalSectionStoreLogs + 8 + typeLen;
-      }
+      // data is the stored value itself
+      memcpy(appendStoreLog(typeLen, addr), &data, typeLen);
 #ifdef DEBUG_UVA
       LOG("[client] storeHandlerForHLRC END\n\n");
 #endif
@@ -660,15 +512,9 @@ namespace corelab {
         return addr;
       }
       
-      void *tmpValue = malloc(num);
-      memcpy(tmpValue, &value, num);
-      struct StoreLog* slog = new StoreLog (static_cast<int>(num), tmpValue, addr);
-      if(!isInCriticalSection) {
-        vecStoreLogs->push_back(slog);
-        sizeStoreLogs = sizeStoreLogs + 8 + num;
-      } else {
-        vecCriticalSectionStoreLogs->push_back(slog);
-        sizeCriticalSectionStoreLogs = sizeCriticalSectionStoreLogs + 8 + num;
+      for (size_t done = 0; done < num; done += STORE_LOG_RECORD_MAX) {
+        size_t size = std::min(num - done, STORE_LOG_RECORD_MAX);
+        memset(appendStoreLog(size, static_cast<char*>(addr) + done), value, size);
       }
 #ifdef UVA_EVAL
       watch.end();
@@ -808,18 +654,10 @@ namespace corelab {
 #ifdef DEBUG_UVA
         LOG("[client] HLRC Memcpy : typeMemcpy (1), slog { %d, %p, %p }\n", num, src, dest);
 #endif
-        void *tmpData = malloc(num);
-        memcpy(tmpData, src, num);
-#ifdef DEBUG_UVA
-        LOG("[client] HLRC Memcpy : tmpData (%d)\n", *((int*)tmpData));
-#endif
-        struct StoreLog *slog = new StoreLog ( static_cast<int>(num), tmpData, dest );
-        if(isInCriticalSection) {
-          vecCriticalSectionStoreLogs->push_back(slog);
-          sizeCriticalSectionStoreLogs = sizeStoreLogs + 8 + num;
-        } else {
-          vecStoreLogs->push_back(slog);
-          sizeStoreLogs = sizeStoreLogs + 8 + num;
+        for (size_t done = 0; done < num; done += STORE_LOG_RECORD_MAX) {
+          size_t size = std::min(num - done, STORE_LOG_RECORD_MAX);
+          memcpy(appendStoreLog(size, static_cast<char*>(dest) + done),
+                 static_cast<char*>(src) + done, size);
         }
 #ifdef UVA_EVAL
         watch.end();
@@ -919,6 +757,69 @@ namespace corelab {
       return intAddr;
     }
 
+    /* Appends a record of size bytes to the current store log; the caller
+     * fills in the data it returns. */
+    static inline char *appendStoreLog(size_t size, void *addr) {
+      StoreLogBuffer &log = isInCriticalSection ? criticalSectionStoreLogs : storeLogs;
+      size_t recordSize = 8 + size;
+      if (log.size + recordSize > log.capacity) {
+        log.capacity = std::max(std::max(log.capacity * 2, STORE_LOG_INITIAL_CAPACITY),
+                                log.size + recordSize);
+        log.data = static_cast<char*>(realloc(log.data, log.capacity));
+        assert(log.data && "[client] cannot grow the store log");
+      }
+      char *record = log.data + log.size;
+      int32_t intSize = static_cast<int32_t>(size);
+      uint32_t intAddr = makeInt32Addr(addr);
+      memcpy(record, &intSize, 4);
+      memcpy(record + 4 + size, &intAddr, 4);
+      log.size += recordSize;
+      return record + 4;
+    }
+
+    /* Bytes of the whole records from offset that fit in one request */
+    static size_t storeLogMessage(StoreLogBuffer &log, size_t offset) {
+      size_t end = offset;
+      while (end < log.size) {
+        int32_t size;
+        memcpy(&size, log.data + end, 4);
+        if (end + 8 + size - offset > STORE_LOG_MESSAGE_MAX)
+          break;
+        end += 8 + size;
+      }
+      return end - offset;
+    }
+
+    /* Receives the list of addresses Home has invalidated and protects
+     * their pages; returns their number */
+    static uint32_t invalidateAddresses(CommManager *comm, uint32_t destid) {
+      comm->receiveQue(destid);
+#ifdef DEBUG_UVA
+      LOG("[client] recv address list\n");
+#endif
+      //int addressSize = socket->takeWordF(); // XXX: Currently, out UVA address space is 32 bits.
+      uint32_t addressNum = comm->takeWord(destid);
+      vector<void*> addressVector;
+      //void** addressbuf = (void **) malloc(addressSize);
+      void** addressbuf = (void **) malloc(4);
+      for(int i = 0; i < addressNum; i++) {
+        //socket->takeRangeF(addressbuf, addressSize);
+        comm->takeRange(addressbuf, 4, destid);
+        addressVector.push_back(*addressbuf);
+      }
+      free(addressbuf);
+      // all address invalidate.
+      
+      for(vector<void*>::iterator it = addressVector.begin(); it != addressVector.end(); it++) {
+        void* address = *it;
+#ifdef DEBUG_UVA
+        //LOG("invalidate address : %p\n", address);
+#endif
+        mprotect(truncToPageAddr(address), PAGE_SIZE, PROT_NONE);
+      }
+      return addressNum;
+    }
+
     /* not exact */
     static inline bool isUVAaddr(void *addr) {
       if ((long)addr > 0xffffffff)
@@ -26,20 +26,6 @@ namespace corelab {
     /* UVAOwnership is deprecated (BONGJUN) */
 		enum UVAOwnership { OWN_MASTER, OWN_SLAVE };
 
-    struct StoreLog {
-      int32_t size;
-      void *data;
-      void *addr;
-      StoreLog(int _size, void* _data, void* _addr) {
-        size = _size;
-        data = _data;
-        addr = _addr;
-      }
-      ~StoreLog() {
-        free(data);
-      }
-    };
-
 		namespace UVAManager {
 			void initialize (CommManager *comm, uint32_t destid);
 